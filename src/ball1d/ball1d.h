@@ -6,6 +6,7 @@
 #define __PARATREET_BALL1D
 
 #include "paratreet.h"
+#include <cmath>
 #include <vector>
 
 /**
@@ -68,32 +69,61 @@ public:
   CUDA_BOTH BallNodeData(float mass,float x,float radius,float xMin,float xMax) :BallLeafData(mass,x,radius), xMin(xMin), xMax(xMax) {}
 };
 
+/**
+ Neighbour output of a BallConsumer that only counts the neighbours found.
+*/
+template <class BallKey>
+struct BallNeighborCounter {
+	long count;
+
+	CUDA_BOTH BallNeighborCounter() :count(0) {}
+	inline CUDA_BOTH void push_back(const BallKey &) { count++; }
+	inline CUDA_BOTH long size() const { return count; }
+};
+
+/**
+ Neighbour output of a BallConsumer that appends the neighbours found to an
+ array shared by many consumers, one after the other.
+*/
+template <class BallKey>
+struct BallNeighborAppender {
+	std::vector<BallKey> *out;
+
+	BallNeighborAppender(std::vector<BallKey> *out = NULL) :out(out) {}
+	inline void push_back(const BallKey &key) { out->push_back(key); }
+};
+
 /**
  A Ball-Search tree data consumer: fixed-radius search for neighbours on nodes and leaves of the tree.
+ Neighbours are appended to a std::vector by default; any Neighbors type with
+ push_back will do, like BallNeighborCounter (see countNeighbors) or BallNeighborAppender.
+ A skin widens the search radius, for lists that stay valid while particles move (see BallVerletLists).
 */
-template <class ParaTree,class BallKey>
+template <class ParaTree,class BallKey,class Neighbors = std::vector<BallKey> >
 struct BallConsumer {
 public:
 	ParaTree &tree;
 	const BallLeafData &me;
     float searchRangeStart;
     float searchRangeEnd;
-    std::vector<BallKey> neighbors;
+    Neighbors neighbors;
 
-	CUDA_BOTH BallConsumer(ParaTree &tree,const BallLeafData &me)
-		:tree(tree), me(me)
+	CUDA_BOTH BallConsumer(ParaTree &tree,const BallLeafData &me,const Neighbors &neighbors = Neighbors(),float skin = 0.0f)
+		:tree(tree), me(me), neighbors(neighbors)
 	{
-        searchRangeStart = me.x - me.searchRadius;
-        searchRangeEnd = me.x + me.searchRadius;
+        searchRangeStart = me.x - (me.searchRadius + skin);
+        searchRangeEnd = me.x + (me.searchRadius + skin);
     }
 
 	/// Consume a tree node: recursively opens the node if nearby, or lumps it if distant.
 	inline CUDA_BOTH void consumeNode(const BallNodeData &n,const BallKey &key) {
+        PARATREET_COUNT(STAT_NODES_VISITED, 1);
 
         if (searchRangeStart > n.xMax || searchRangeEnd < n.xMin) {
             // out-of-bounds
             return;
         }
+        PARATREET_COUNT(STAT_NODES_OPENED, 1);
 
         if (searchRangeEnd >= n.xMin && searchRangeEnd <= n.x) {
             // contained in left child range
@@ -114,16 +144,134 @@ public:
 
 	}
 
-	/// Consume a tree leaf: just computes gravity.
+	/// Consume a tree leaf: a neighbour if it's in range.  Massless leaves pad the tree out, and aren't anyone's neighbours.
 	inline CUDA_BOTH void consumeLeaf(const BallLeafData &l,const BallKey &key) {
 		TRACE_BARNES(printf("Me = %.0f, leaf gravity from %.0f\n",me.x,l.x));
+        PARATREET_COUNT(STAT_NODES_VISITED, 1);
+        PARATREET_COUNT(STAT_LEAF_INTERACTIONS, 1);
 
-        if (l.x >= searchRangeStart && l.x <= searchRangeEnd) {
+        if (l.mass != 0.0f && l.x >= searchRangeStart && l.x <= searchRangeEnd) {
             neighbors.push_back(key);
         }
 	}
 
 };
 
+/**
+ Neighbour lists of many particles in CSR form: the neighbours of particle i
+ are indices[offsets[i]] up to indices[offsets[i+1]].
+*/
+template <class BallKey>
+struct BallNeighborLists {
+	std::vector<long> offsets;
+	std::vector<BallKey> indices;
+
+	/// Number of particles
+	long size() const { return (long)offsets.size() - 1; }
+	/// Number of neighbours of particle i
+	long count(long i) const { return offsets[i + 1] - offsets[i]; }
+	/// Neighbours of particle i
+	const BallKey *neighbors(long i) const { return indices.data() + offsets[i]; }
+};
+
+/**
+ Search the neighbours of n leaves into CSR lists, out to their search radius
+ plus skin.  Each search appends its neighbours to the one index array, which
+ acts as an arena: it keeps its capacity from one call to the next, so once
+ it is big enough no search allocates at all.
+*/
+template <class ParaTree,class BallKey,class Leaf>
+void findNeighborLists(ParaTree &tree,const BallKey &root,const Leaf *leaves,long n,BallNeighborLists<BallKey> &lists,float skin = 0.0f) {
+	lists.offsets.resize(n + 1);
+	lists.offsets[0] = 0;
+	lists.indices.clear();
+	for (long i = 0; i < n; i++) {
+		BallConsumer<ParaTree,BallKey,BallNeighborAppender<BallKey> > c(tree, leaves[i], &lists.indices, skin);
+		tree.requestKey(root, c);
+		lists.offsets[i + 1] = lists.indices.size();
+	}
+}
+
+/// Count the neighbours of n leaves, out to their search radius plus skin, without storing them
+template <class ParaTree,class BallKey,class Leaf>
+long countNeighbors(ParaTree &tree,const BallKey &root,const Leaf *leaves,long n,float skin = 0.0f) {
+	long count = 0;
+	for (long i = 0; i < n; i++) {
+		BallConsumer<ParaTree,BallKey,BallNeighborCounter<BallKey> > c(tree, leaves[i], BallNeighborCounter<BallKey>(), skin);
+		tree.requestKey(root, c);
+		count += c.neighbors.size();
+	}
+	return count;
+}
+
+/**
+ Verlet neighbour lists: the neighbours of particles 0 to n-1, reused from one
+ time step to the next.
+
+ The lists are searched out to each particle's search radius plus a skin, so
+ they hold every pair that can come within the search radius before some
+ particle has moved skin/2 from where it was searched: until then the tree
+ isn't searched again.  Users keep the listed neighbours that are within the
+ radius now.
+
+ The lists are kept by particle, not by leaf key, so the tree may be rebuilt
+ (and its leaves reordered) before each search.
+*/
+template <class BallKey>
+struct BallVerletLists {
+	float skin;
+	BallNeighborLists<long> lists; // neighbours of each particle, by particle
+	std::vector<float> searchedX; // where the particles were at the last search
+	BallNeighborLists<BallKey> found; // the last search, by leaf (reused)
+	long searches; // tree searches so far
+
+	BallVerletLists(float skin) :skin(skin), searches(0) {}
+
+	/// Farthest any of the n particles at x has moved since the last search
+	float maxDisplacement(const float *x,long n) const {
+		float moved = 0.0f;
+		for (long i = 0; i < n; i++)
+			moved = fmaxf(moved, fabsf(x[i] - searchedX[i]));
+		return moved;
+	}
+
+	/// Must the tree be searched again for the n particles at x?
+	bool stale(const float *x,long n) const {
+		return (long)searchedX.size() != n || maxDisplacement(x, n) > skin/2;
+	}
+
+	/**
+	 Search the lists again, in a tree built from the n particles at x: leaf
+	 firstLeaf+j holds particle particle[j].
+	*/
+	template <class ParaTree,class Leaf>
+	void search(ParaTree &tree,const BallKey &root,const BallKey &firstLeaf,const Leaf *leaves,
+			const long *particle,long n,const float *x) {
+		searches++;
+		findNeighborLists(tree, root, leaves, n, found, skin);
+		// Regroup the lists by particle, translating leaf keys into particles: count, then fill
+		lists.offsets.assign(n + 1, 0);
+		for (long j = 0; j < n; j++)
+			lists.offsets[particle[j] + 1] = found.count(j);
+		for (long i = 0; i < n; i++)
+			lists.offsets[i + 1] += lists.offsets[i];
+		lists.indices.resize(lists.offsets[n]);
+		for (long j = 0; j < n; j++) {
+			long *out = lists.indices.data() + lists.offsets[particle[j]];
+			for (long k = 0; k < found.count(j); k++)
+				*out++ = particle[found.neighbors(j)[k] - firstLeaf];
+		}
+		searchedX.assign(x, x + n);
+	}
+};
+
+namespace ParaTreeT {
+/// Ball searches send back short neighbour lists, so ship them to remote subtrees
+template <class ParaTree,class BallKey,class Neighbors>
+struct RemotePolicy<BallConsumer<ParaTree,BallKey,Neighbors> > {
+	enum { walk = SHIP_CONSUMER };
+};
+};
+
 #endif
 
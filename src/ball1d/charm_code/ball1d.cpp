@@ -1,10 +1,15 @@
 #include "pup.h"
+#include "pup_stl.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <cmath>
+#include <algorithm>
 #include <iostream>
+#include <vector>
 using namespace std;
 #include "ball1d.h"
+#include "paratreet_output.h"
+#include "paratreet_trace.h"
 #include "ball.decl.h"
 
 /// Define DEBUG(x) to x if you need to print out a lot of statements
@@ -12,6 +17,16 @@ using namespace std;
 
 /* readonly */ CProxy_Main mainProxy;
 /* readonly */ CProxy_BallTreePiece tpProxy;
+/* readonly */ bool tracing; // record a timeline of phases on every PE
+
+/// Size of one piece's results, as contributed to the result size gather
+struct ResultSize {
+  int piece;
+  long size;
+};
+
+/// Credit carried by each shipped consumer, split between the pieces it visits
+static const unsigned long walkCredit = 1ul << 62;
 
 /**
 Trivial Ball Tree piece
@@ -34,50 +49,121 @@ class BallTreePiece : public CBase_BallTreePiece {
     /// Counter to keep a track of number of remote node requests sent
     int remoteCounter = 0;
 
+    /// How walks continue into remote nodes (a ParaTreeT::RemoteWalk)
+    int policy = ParaTreeT::FETCH_DATA;
+
+    /// Credit of our shipped consumers not yet returned: zero once they all finished
+    unsigned long outstandingCredit = 0;
+
+    /// Keys opened by a consumer visiting from another piece, to forward it to
+    std::vector<BallKey> *forwards = NULL;
+
+    /// Number of walk messages sent by this piece
+    int messages = 0;
+
+    /// Result of our consumer: our key, its number of neighbors, then their keys
+    ParaTreeT::ResultBuffer results;
+
     BallTreePiece(BallNodeData tpnode, BallKey firstLeaf, BallKey treeSize) : node(tpnode), firstLeaf(firstLeaf), treeSize(treeSize) {
       /// Create a constructor only if the node is a leaf
       if (thisIndex >= firstLeaf)
         cons = new BallConsumer<BallTreePiece, BallKey>(*this, node);
+      ParaTreeT::traceEnable(tracing);
     }
 
     /// Check if all remote requests have completed
     void checkDone() {
-      if (remoteCounter == 0) {
+      if (remoteCounter == 0 && outstandingCredit == 0) {
         DEBUG(CkPrintf("[%d]remoteCounter == 0\n", thisIndex);)
         if (thisIndex >= firstLeaf){
-          cout << "Particle " << thisIndex << " has neighbors:";
-          for (int i = 0; i < cons->neighbors.size(); i++)
-          cout << " " << cons->neighbors[i];
-          cout << endl;
+          sort(cons->neighbors.begin(), cons->neighbors.end());
+          BallKey key = thisIndex;
+          long n = cons->neighbors.size();
+          results.clear();
+          results.put(key);
+          results.put(n);
+          results.put(cons->neighbors.data(), n);
         }
         contribute(CkCallback(CkReductionTarget(Main, done), mainProxy));
       }
     }
 
-    /// Begin computation
-    void startWork() {
+    /// Begin computation, continuing walks into remote nodes with this policy
+    void startWork(int walkPolicy) {
       DEBUG(CkPrintf("[%d]startWork()\n", thisIndex);)
+      double start = ParaTreeT::traceBegin();
       remoteCounter = 0;
-      if (thisIndex >= firstLeaf)
+      outstandingCredit = 0;
+      policy = walkPolicy;
+      if (thisIndex >= firstLeaf) {
+        cons->neighbors.clear();
         requestKey(1, *cons);
+      }
+      ParaTreeT::traceEnd("walk", start);
       checkDone();
     }
 
+    /// Contribute the traversal counters of this PE (if we are its first piece)
+    void reportStats() {
+      PARATREET_STAT(ParaTreeT::contributeStats(this, CkCallback(CkIndex_Main::statsReported(NULL), mainProxy));)
+    }
+
+    /// Contribute the phases traced on this PE (if we are its first piece), when PARATREET_TRACE is set
+    void shareTrace() {
+      std::vector<ParaTreeT::TraceEvent> mine = ParaTreeT::takeThreadTraceEvents();
+      contribute(mine.size()*sizeof(ParaTreeT::TraceEvent), mine.data(), CkReduction::concat,
+          CkCallback(CkIndex_Main::traceGathered(NULL), mainProxy));
+    }
+
+    /// Sum up the walk messages sent since the last count, once every piece is done
+    void countMessages() {
+      contribute(sizeof(int), &messages, CkReduction::sum_int, CkCallback(CkReductionTarget(Main, counted), mainProxy));
+      messages = 0;
+    }
+
+    /// Report the size of our results, so Main can work out where each piece writes them
+    void shareResultSize() {
+      ResultSize mine = {thisIndex, (long)results.size()};
+      contribute(sizeof(mine), &mine, CkReduction::concat,
+          CkCallback(CkIndex_Main::resultSizes(NULL), mainProxy));
+    }
+
+    /// Write our results at our offset in the result file
+    void writeResults(long offset, const std::string &path) {
+      {
+        PARATREET_TRACE_PHASE("output");
+        ParaTreeT::writeResults(path.c_str(), offset, results);
+      }
+      contribute(CkCallback(CkReductionTarget(Main, resultsWritten), mainProxy));
+    }
+
     BallTreePiece(CkMigrateMessage *m) {}
 
     /// Method called to request a node
     template <class Consumer>
     void requestKey(const BallKey &bk, Consumer &c) {
+      PARATREET_STACK_DEPTH;
+      PARATREET_COUNT(STAT_WALKS, bk == 1 && !forwards);
       if (bk < 1 || bk >= treeSize)
         CkPrintf("BallParaTree: Requested INVALID tree node %d\n", (int)bk);
+      else if (forwards)  //Visiting consumer: continue its walk where the node is
+        forwards->push_back(bk);
       else if (bk == thisIndex) {   //Local node
         if (bk >= firstLeaf)
           c.consumeLeaf(node, bk);  //Call consumer's leaf method
         else
           c.consumeNode(node, bk);  //Call consumer's node method
       }
+      else if (policy == ParaTreeT::SHIP_CONSUMER) { //Remote node: ship the consumer to it
+        outstandingCredit += walkCredit;
+        messages++;
+        PARATREET_COUNT(STAT_REMOTE_REQUESTS, 1);
+        thisProxy[bk].visit(c.me, bk, thisIndex, walkCredit);
+      }
       else { //Remote node
         remoteCounter++;
+        messages++;
+        PARATREET_COUNT(STAT_REMOTE_REQUESTS, 1);
         //Send a remote node request
         thisProxy[bk].requestRemoteNode(bk, thisIndex);
       }
@@ -91,6 +177,7 @@ class BallTreePiece : public CBase_BallTreePiece {
 
     /// Entry method called to request for a remote node
     void requestRemoteNode(BallKey bk, int consIndex) {
+      messages++;
       if (bk >= firstLeaf)
         thisProxy[consIndex].consumeRemoteLeaf(node, bk);
       else
@@ -100,14 +187,71 @@ class BallTreePiece : public CBase_BallTreePiece {
     /// Entry method called to respond to a remote node request which is an internal node
     void consumeRemoteNode(const BallNodeData &n, const BallKey &key) {
       remoteCounter--;
-      cons->consumeNode(n, key); //Call consumer's node method now that remote node is available
+      PARATREET_COUNT(STAT_BYTES_RECEIVED, sizeof(n));
+      {
+        PARATREET_TRACE_PHASE("remote walk");
+        cons->consumeNode(n, key); //Call consumer's node method now that remote node is available
+      }
       checkDone();
     }
 
     /// Entry method called to respond to a remote node request which is a leaf node
     void consumeRemoteLeaf(const BallLeafData &n, const BallKey &key) {
       remoteCounter--;
-      cons->consumeLeaf(n, key); //Call consumer's leaf method now that remote leaf is available
+      PARATREET_COUNT(STAT_BYTES_RECEIVED, sizeof(n));
+      {
+        PARATREET_TRACE_PHASE("remote walk");
+        cons->consumeLeaf(n, key); //Call consumer's leaf method now that remote leaf is available
+      }
+      checkDone();
+    }
+
+    /**
+     Entry method called with a consumer shipped from piece origin, to walk our node.
+     The walk is forwarded to each child it opens, splitting its credit between them;
+     the partial result goes back to origin with the credit left, and with the children
+     the credit was too small to split between, for origin to ship with fresh credit.
+    */
+    void visit(const BallLeafData &me, const BallKey &key, int origin, unsigned long credit) {
+      PARATREET_TRACE_PHASE("visit");
+      BallConsumer<BallTreePiece, BallKey> c(*this, me);
+      std::vector<BallKey> next, reship;
+      forwards = &next;
+      if (key >= firstLeaf)
+        c.consumeLeaf(node, key);
+      else
+        c.consumeNode(node, key);
+      forwards = NULL;
+
+      // Keep a share for our own result, unless there is none and the children take it all
+      bool report = !c.neighbors.empty() || next.empty();
+      unsigned long parts = next.size() + (report ? 1 : 0);
+      if (credit < parts) {
+        reship.swap(next);
+        report = true;
+      }
+      for (int i = 0; i < next.size(); i++) {
+        unsigned long share = credit / (parts - i);
+        credit -= share;
+        messages++;
+        thisProxy[next[i]].visit(me, next[i], origin, share);
+      }
+      if (report) {
+        messages++;
+        thisProxy[origin].visitDone(c.neighbors, reship, credit);
+      }
+    }
+
+    /// Entry method called with the partial result of one of our shipped consumers
+    void visitDone(const std::vector<BallKey> &neighbors, const std::vector<BallKey> &reship, unsigned long credit) {
+      PARATREET_COUNT(STAT_BYTES_RECEIVED, neighbors.size()*sizeof(BallKey));
+      cons->neighbors.insert(cons->neighbors.end(), neighbors.begin(), neighbors.end());
+      for (int i = 0; i < reship.size(); i++) {
+        outstandingCredit += walkCredit;
+        messages++;
+        thisProxy[reship[i]].visit(cons->me, reship[i], thisIndex, walkCredit);
+      }
+      outstandingCredit -= credit;
       checkDone();
     }
 };
@@ -117,17 +261,51 @@ class Main : public CBase_Main {
     BallNodeData *tree;
     BallKey treeSize, treeRoot, firstLeaf;
 
+    /// Remote walk policies to run, in order, and the one running now
+    std::vector<int> policies;
+    int run;
+    double startTime, runTime;
+
+    /// File the neighbor lists are written to (none if empty), and when writing started
+    std::string resultFile;
+    double outputStart;
+
+    /// File the timeline of phases is written to, if tracing
+    std::string traceFile;
+
   Main(CkArgMsg *m) {
     int depth = 3;
-    if (m->argc == 2) {
+    if (m->argc >= 2) {
       depth = atoi(m->argv[1]);
     }
+    // Benchmark mode runs the search once per remote walk policy
+    bool benchmark = false;
+    if (m->argc >= 3) {
+      benchmark = atoi(m->argv[2]);
+    }
+    if (m->argc >= 4) {
+      resultFile = m->argv[3];
+    }
+    if (benchmark) {
+      policies.push_back(ParaTreeT::FETCH_DATA);
+      policies.push_back(ParaTreeT::SHIP_CONSUMER);
+    }
+    else
+      policies.push_back(ParaTreeT::RemotePolicy<BallConsumer<BallTreePiece, BallKey> >::walk);
+    // Record phases for a timeline if PARATREET_TRACE names a file
+    const char *traceEnv = ParaTreeT::traceFileFromEnv();
+    tracing = (traceEnv != NULL);
+    if (tracing) traceFile = traceEnv;
+    ParaTreeT::traceEnable(tracing);
     treeSize = (BallKey)pow(2, depth);
     treeRoot = 1;
     firstLeaf = pow(2, depth-1);
 
     tree = new BallNodeData[treeSize];
-    constructNode(treeRoot, 0.0, 100.0);
+    {
+      PARATREET_TRACE_PHASE("build");
+      constructNode(treeRoot, 0.0, 100.0);
+    }
 
     mainProxy = thisProxy;
     tpProxy = CProxy_BallTreePiece::ckNew();
@@ -140,14 +318,90 @@ class Main : public CBase_Main {
     tpProxy.doneInserting();
     CkPrintf("[Main] Create tree-piece array\n");
 
-    tpProxy.startWork();
+    run = 0;
+    startRun();
   }
 
   Main(CkMigrateMessage *m){}
 
+  /// Start a search with the current remote walk policy
+  void startRun() {
+    startTime = CkWallTimer();
+    tpProxy.startWork(policies[run]);
+  }
+
   /// Method called on reduction to indicate end of compuatations
   void done() {
+    runTime = CkWallTimer() - startTime;
+#ifdef PARATREET_STATS
+    tpProxy.reportStats();
+#else
+    tpProxy.countMessages();
+#endif
+  }
+
+  /// Method called on reduction with the traversal counters of every PE
+  void statsReported(CkReductionMsg *m) {
+    PARATREET_STAT(ParaTreeT::reducedStats(m).print("[Main] Traversal statistics");)
+    delete m;
+    tpProxy.countMessages();
+  }
+
+  /// Method called on reduction with the number of walk messages sent
+  void counted(int messages) {
+    CkPrintf("[Main] %s: %.6f s, %d messages\n",
+        policies[run] == ParaTreeT::SHIP_CONSUMER ? "Ship consumers" : "Fetch data",
+        runTime, messages);
+    if (++run < policies.size()) {
+      startRun();
+      return;
+    }
     CkPrintf("[Main] Done with 1D Ball-Search computations\n");
+    if (resultFile.empty()) {
+      finish();
+      return;
+    }
+    outputStart = CkWallTimer();
+    tpProxy.shareResultSize();
+  }
+
+  /// Method called with the result size of every piece, in any order: each piece writes at the sum of those before it
+  void resultSizes(CkReductionMsg *m) {
+    int n = m->getSize()/sizeof(ResultSize);
+    ResultSize *entries = (ResultSize *)m->getData();
+    std::vector<long> sizes(treeSize, 0); // there is no piece 0
+    for (int i = 0; i < n; i++)
+      sizes[entries[i].piece] = entries[i].size;
+    delete m;
+    std::vector<long> offsets = ParaTreeT::resultOffsets(sizes);
+    if (!ParaTreeT::createResultFile(resultFile.c_str(), offsets[treeSize])) {
+      finish();
+      return;
+    }
+    for (int i = 1; i < treeSize; i++)
+      tpProxy[i].writeResults(offsets[i], resultFile);
+  }
+
+  /// Method called on reduction once every piece wrote its results
+  void resultsWritten() {
+    CkPrintf("[Main] Output: %.6f s to write results to %s\n", CkWallTimer() - outputStart, resultFile.c_str());
+    finish();
+  }
+
+  /// Exit, first gathering the timeline of phases if tracing
+  void finish() {
+    if (tracing)
+      tpProxy.shareTrace();
+    else
+      CkExit();
+  }
+
+  /// Method called with the phases traced on every PE: write the timeline, then exit
+  void traceGathered(CkReductionMsg *m) {
+    int n = m->getSize()/sizeof(ParaTreeT::TraceEvent);
+    if (ParaTreeT::writeTrace(traceFile.c_str(), (ParaTreeT::TraceEvent *)m->getData(), n))
+      CkPrintf("[Main] Wrote %d traced phases to %s\n", n, traceFile.c_str());
+    delete m;
     CkExit();
   }
 
@@ -155,7 +409,7 @@ class Main : public CBase_Main {
   void constructNode(int index, float xMin, float xMax) {
     // Interior node
     if (2*index<treeSize) {
-			cout<<"Tree Node: Ind:"<<index<<" xMin:"<<xMin<<" xMax:"<<xMax<<endl;
+			DEBUG(cout<<"Tree Node: Ind:"<<index<<" xMin:"<<xMin<<" xMax:"<<xMax<<endl;)
       float xMid = (xMin+xMax)/2;
       tree[index] = BallNodeData(20.0, xMid, 0.0f, xMin, xMax);
 
@@ -170,7 +424,7 @@ class Main : public CBase_Main {
       float random = ((float) rand()) / (float) RAND_MAX;
       float xPos= xMin + random*(xMax - xMin);
 
-			cout<<"Tree Leaf: Ind:"<<index<<" xPos:"<<xPos<<endl;
+			DEBUG(cout<<"Tree Leaf: Ind:"<<index<<" xPos:"<<xPos<<endl;)
       tree[index] = BallNodeData(20.0, xPos, 25.0f, xMin, xMax);
     }
   }
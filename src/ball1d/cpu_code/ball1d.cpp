@@ -1,7 +1,15 @@
 #include "ball1d_cputree.h"
+#include "paratreet_output.h"
+#include "paratreet_trace.h"
+#include <chrono>
+#include <string.h>
 
 int main(int argc, char *argv[]){
 
+	//record phases for a timeline if PARATREET_TRACE names a file
+	const char *traceFile = ParaTreeT::traceFileFromEnv();
+	ParaTreeT::traceEnable(traceFile != NULL);
+
 	//depth of the binary tree
 	int depth = 3;
 	BallKey treeRoot=1;
@@ -11,23 +19,88 @@ int main(int argc, char *argv[]){
 
 	//recursively construct tree starting from the root
 	cout<<"*********BUILDING TREE*********\n";
-	t.constructNode(treeRoot, 0.0, 100.0);
+	{
+		PARATREET_TRACE_PHASE("build");
+		t.constructNode(treeRoot, 0.0, 100.0);
+	}
 
 	//traverse the tree starting from the root
 	DEBUG(cout<<"*********TRAVERSING TREE*********\n";)
 	DEBUG(t.printSubTree(treeRoot);)
 
-	DEBUG(cout<<"*********COMPUTING GRAVITY*********\n";)
-	//Iterate over all leaves and compute their gravity and print accelerations
-	for(int i=0;i<t.size;i++){
-		//check if the node is a leaf
-		if(i>=pow(2,depth)){
-			BallConsumer<typeof(t),BallKey> c(t, t.node[i]);
-			t.requestKey(treeRoot, c);
-			cout<<"Particle "<<i<<" has an neighbors : ";
-            for (int i=0; i < c.neighbors.size(); i++)
-                cout<<" "<<c.neighbors[i]<<" ";
-            cout<<endl;
+	DEBUG(cout<<"*********COMPUTING NEIGHBORS*********\n";)
+	//Find the neighbors of all leaves: as CSR lists if they are written ("-" for none), else just count them
+	bool output = argc >= 2 && strcmp(argv[1], "-") != 0;
+	BallNeighborLists<BallKey> lists;
+	long found;
+	double walkStart = ParaTreeT::traceBegin();
+	if (output) {
+		findNeighborLists(t, treeRoot, t.node + t.firstLeaf, t.size - t.firstLeaf, lists);
+		found = lists.indices.size();
+	}
+	else
+		found = countNeighbors(t, treeRoot, t.node + t.firstLeaf, t.size - t.firstLeaf);
+	ParaTreeT::traceEnd("walk", walkStart);
+	cout<<"Found "<<found<<" neighbors"<<endl;
+	PARATREET_STAT(ParaTreeT::totalStats().print("Traversal statistics");)
+	//Write the results, timing the output on its own
+	if (output) {
+		PARATREET_TRACE_PHASE("output");
+		//Each result is the leaf key, the number of neighbors, then their keys
+		ParaTreeT::ResultBuffer results;
+		for(long i=0;i<lists.size();i++){
+			BallKey key = t.firstLeaf + i;
+			long n = lists.count(i);
+			results.put(key);
+			results.put(n);
+			results.put(lists.neighbors(i), n);
+		}
+		auto t1 = std::chrono::high_resolution_clock::now();
+		if (ParaTreeT::writeResultFile(argv[1], results)) {
+			auto t2 = std::chrono::high_resolution_clock::now();
+			cout<<"Wrote "<<results.size()<<" bytes of results to "<<argv[1]<<" in "
+				<<std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count()<<" us"<<endl;
+		}
+	}
+	//Move the particles for a number of steps, reusing Verlet lists searched with this skin
+	int steps = (argc >= 3) ? atoi(argv[2]) : 0;
+	float skin = (argc >= 4) ? atof(argv[3]) : 5.0f;
+	if (steps > 0) {
+		long n = t.size - t.firstLeaf;
+		float radius = t.node[t.firstLeaf].searchRadius;
+		vector<float> x(n), v(n);
+		for(long i=0;i<n;i++){
+			x[i] = t.node[t.firstLeaf + i].x;
+			v[i] = ((float) rand()) / (float) RAND_MAX - 0.5f;
+		}
+		BallVerletLists<BallKey> verlet(skin);
+		vector<long> order;
+		long pairs = 0;
+		auto t1 = std::chrono::high_resolution_clock::now();
+		for(int step=0;step<steps;step++){
+			//drift, bouncing off the ends of the box
+			for(long i=0;i<n;i++){
+				x[i] += v[i];
+				if (x[i] < 0.0f || x[i] > 100.0f) { v[i] = -v[i]; x[i] += 2*v[i]; }
+			}
+			if (verlet.stale(x.data(), n)) {
+				PARATREET_TRACE_PHASE("verlet search");
+				if (!t.load(x.data(), n, radius, order)) return 1;
+				verlet.search(t, treeRoot, t.firstLeaf, t.node + t.firstLeaf, order.data(), n, x.data());
+			}
+			//the listed neighbours still within the radius
+			PARATREET_TRACE_PHASE("verlet step");
+			for(long i=0;i<n;i++){
+				const long *nb = verlet.lists.neighbors(i);
+				for(long k=0;k<verlet.lists.count(i);k++)
+					pairs += fabsf(x[nb[k]] - x[i]) <= radius;
+			}
 		}
+		auto t2 = std::chrono::high_resolution_clock::now();
+		cout<<"Verlet lists: "<<pairs<<" neighbors over "<<steps<<" steps in "
+			<<std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count()<<" us, "
+			<<verlet.searches<<" tree searches"<<endl;
 	}
+	if (traceFile && ParaTreeT::writeTraceFile(traceFile))
+		cout<<"Wrote trace to "<<traceFile<<endl;
 }
@@ -11,7 +11,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <cmath>
+#include <algorithm>
 #include <iostream>
+#include <vector>
 using namespace std;
 #include "ball1d.h"
 
@@ -33,6 +35,8 @@ class BallParaTree{
 	//Process node requests and send back nodes/leaves
 	template <class Consumer>
 	void requestKey(BallKey bk, Consumer &c){
+		PARATREET_STACK_DEPTH;
+		PARATREET_COUNT(STAT_WALKS, bk == 1);
 		if(bk<1 || bk>= size) printf("BallParaTree: Requested INVALID tree node %d\n", (int)bk);
 		else{
 			if(bk>=firstLeaf)
@@ -74,6 +78,45 @@ class BallParaTree{
 		}
 	}
 
+  /// Fill the leaves with n particles at x, sorted, each with this search radius, then compute the nodes above them.
+  /// order receives the particle in each leaf; the leaves after them are massless copies of the last one.
+  /// Returns false, leaving the tree as it was, if the particles don't fit in the leaves.
+	bool load(const float *x, long n, float searchRadius, std::vector<long> &order){
+		if(!loadLeaves(x, n, searchRadius, order)) return false;
+		computeNodes();
+		return true;
+	}
+
+  /// The leaves half of load
+	bool loadLeaves(const float *x, long n, float searchRadius, std::vector<long> &order){
+		long nLeaves = size - firstLeaf;
+		if(n < 1 || n > nLeaves){
+			printf("BallParaTree: %ld particles don't fit in %ld leaves\n", n, nLeaves);
+			return false;
+		}
+		order.resize(n);
+		for(long i=0;i<n;i++) order[i] = i;
+		std::sort(order.begin(), order.end(), [x](long a, long b){ return x[a] < x[b]; });
+
+		///leaves: each cell reaches halfway to its neighbours
+		for(long i=0;i<nLeaves;i++){
+			long j = std::min(i, n-1);
+			float xPos = x[order[j]];
+			float xMin = (j > 0) ? (x[order[j-1]] + xPos)/2 : xPos;
+			float xMax = (j+1 < n) ? (xPos + x[order[j+1]])/2 : xPos;
+			node[firstLeaf+i] = BallNodeData((i < n) ? 20.0f : 0.0f, xPos, searchRadius, xMin, xMax);
+		}
+		return true;
+	}
+
+  /// The nodes half of load: interior nodes span their children, split where their cells meet
+	void computeNodes(){
+		for(int index=firstLeaf-1;index>=1;index--){
+			const BallNodeData &l = node[2*index], &r = node[2*index+1];
+			node[index] = BallNodeData(l.mass+r.mass, l.xMax, 0.0f, l.xMin, r.xMax);
+		}
+	}
+
 	void printSubTree(int index){
 		if(2*index+1<size){
 			BallNodeData thisNode = node[index];
@@ -94,6 +94,7 @@ public:
 	
 	/// Consume a tree node: recursively opens the node if nearby, or lumps it if distant.
 	inline CUDA_BOTH void consumeNode(const BarnesNodeData &n,const BarnesKey &key) { 
+		PARATREET_COUNT(STAT_NODES_VISITED, 1);
 		float radius=n.xMax-n.x;
 		float distance=me.x-n.x;
 		float angularSize=radius/abs(distance);
@@ -101,9 +102,11 @@ public:
 		
 		if (angularSize>openingThreshold) { // open recursively
 			TRACE_BARNES(printf("Me = %.0f, opening node %d (angular %.2f)\n",me.x,key,angularSize));
+			PARATREET_COUNT(STAT_NODES_OPENED, 1);
 			tree.requestChildren(key,*this);
 		} else { // compute acceleration to lumped centroid
 			TRACE_BARNES(printf("Me = %.0f, lumping gravity from %.0f (angular %.2f)\n",me.x,n.x,angularSize));
+			PARATREET_COUNT(STAT_NODE_INTERACTIONS, 1);
 			addGravity(n);
 		}
 	}
@@ -111,6 +114,8 @@ public:
 	/// Consume a tree leaf: just computes gravity.
 	inline CUDA_BOTH void consumeLeaf(const BarnesLeafData &l,const BarnesKey &key) { 
 		TRACE_BARNES(printf("Me = %.0f, leaf gravity from %.0f\n",me.x,l.x));
+		PARATREET_COUNT(STAT_NODES_VISITED, 1);
+		PARATREET_COUNT(STAT_LEAF_INTERACTIONS, 1);
 		addGravity(l);
 	}
 	
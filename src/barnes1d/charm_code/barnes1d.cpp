@@ -2,8 +2,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <cmath>
+#include <string>
+#include <vector>
 using namespace std;
 #include "barnes1d.h"
+#include "paratreet_trace.h"
 #include "barnes.decl.h"
 
 /// Define DEBUG(x) to x if you need to print out a lot of statements
@@ -11,6 +14,7 @@ using namespace std;
 
 /* readonly */ CProxy_Main mainProxy;
 /* readonly */ CProxy_BarnesTreePiece tpProxy;
+/* readonly */ bool tracing; // record a timeline of phases on every PE
 
 /**
 Trivial Barnes Tree piece
@@ -37,6 +41,7 @@ class BarnesTreePiece : public CBase_BarnesTreePiece {
       /// Create a constructor only if the node is a leaf
       if (thisIndex >= firstLeaf)
         cons = new BarnesConsumer<BarnesTreePiece, BarnesKey>(*this, node);
+      ParaTreeT::traceEnable(tracing);
     }
 
     /// Check if all remote requests have completed
@@ -54,8 +59,10 @@ class BarnesTreePiece : public CBase_BarnesTreePiece {
     void startWork() {
       DEBUG(CkPrintf("[%d]startWork()\n", thisIndex);)
       remoteCounter = 0;
-      if (thisIndex >= firstLeaf)
+      if (thisIndex >= firstLeaf) {
+        PARATREET_TRACE_PHASE("walk");
         requestKey(1, *cons);
+      }
       checkDone();
     }
 
@@ -64,6 +71,8 @@ class BarnesTreePiece : public CBase_BarnesTreePiece {
     /// Method called to request a node
     template <class Consumer>
     void requestKey(const BarnesKey &bk, Consumer &c) {
+      PARATREET_STACK_DEPTH;
+      PARATREET_COUNT(STAT_WALKS, bk == 1);
       if (bk < 1 || bk >= treeSize)
         CkPrintf("BarnesParaTree: Requested INVALID tree node %d\n", (int)bk);
       else if (bk == thisIndex) {   //Local node
@@ -74,6 +83,7 @@ class BarnesTreePiece : public CBase_BarnesTreePiece {
       }
       else { //Remote node
         remoteCounter++;
+        PARATREET_COUNT(STAT_REMOTE_REQUESTS, 1);
         //Send a remote node request
         thisProxy[bk].requestRemoteNode(bk, thisIndex);
       }
@@ -85,6 +95,18 @@ class BarnesTreePiece : public CBase_BarnesTreePiece {
       requestKey(rightChild(*this,bk),c);
     }
 
+    /// Contribute the traversal counters of this PE (if we are its first piece)
+    void reportStats() {
+      PARATREET_STAT(ParaTreeT::contributeStats(this, CkCallback(CkIndex_Main::statsReported(NULL), mainProxy));)
+    }
+
+    /// Contribute the phases traced on this PE (if we are its first piece), when PARATREET_TRACE is set
+    void shareTrace() {
+      std::vector<ParaTreeT::TraceEvent> mine = ParaTreeT::takeThreadTraceEvents();
+      contribute(mine.size()*sizeof(ParaTreeT::TraceEvent), mine.data(), CkReduction::concat,
+          CkCallback(CkIndex_Main::traceGathered(NULL), mainProxy));
+    }
+
     /// Entry method called to request for a remote node
     void requestRemoteNode(BarnesKey bk, int consIndex) {
       if (bk >= firstLeaf)
@@ -96,14 +118,22 @@ class BarnesTreePiece : public CBase_BarnesTreePiece {
     /// Entry method called to respond to a remote node request which is an internal node
     void consumeRemoteNode(const BarnesNodeData &n, const BarnesKey &key) {
       remoteCounter--;
-      cons->consumeNode(n, key); //Call consumer's node method now that remote node is available
+      PARATREET_COUNT(STAT_BYTES_RECEIVED, sizeof(n));
+      {
+        PARATREET_TRACE_PHASE("remote walk");
+        cons->consumeNode(n, key); //Call consumer's node method now that remote node is available
+      }
       checkDone();
     }
 
     /// Entry method called to respond to a remote node request which is a leaf node
     void consumeRemoteLeaf(const BarnesLeafData &n, const BarnesKey &key) {
       remoteCounter--;
-      cons->consumeLeaf(n, key); //Call consumer's leaf method now that remote leaf is available
+      PARATREET_COUNT(STAT_BYTES_RECEIVED, sizeof(n));
+      {
+        PARATREET_TRACE_PHASE("remote walk");
+        cons->consumeLeaf(n, key); //Call consumer's leaf method now that remote leaf is available
+      }
       checkDone();
     }
 };
@@ -113,14 +143,26 @@ class Main : public CBase_Main {
     BarnesNodeData *tree;
     BarnesKey treeSize, treeRoot, firstLeaf;
 
+    /// File the timeline of phases is written to, if tracing
+    std::string traceFile;
+
   Main(CkArgMsg *m) {
     int depth = 10; // Number of levels in Barnes-Hut  tree
     treeSize = (BarnesKey)pow(2, depth);
     treeRoot = 1;
     firstLeaf = pow(2, depth-1);
 
+    // Record phases for a timeline if PARATREET_TRACE names a file
+    const char *traceEnv = ParaTreeT::traceFileFromEnv();
+    tracing = (traceEnv != NULL);
+    if (tracing) traceFile = traceEnv;
+    ParaTreeT::traceEnable(tracing);
+
     tree = new BarnesNodeData[treeSize];
-    constructNode(treeRoot, 0.0, 100.0);
+    {
+      PARATREET_TRACE_PHASE("build");
+      constructNode(treeRoot, 0.0, 100.0);
+    }
 
     mainProxy = thisProxy;
     tpProxy = CProxy_BarnesTreePiece::ckNew();
@@ -140,7 +182,35 @@ class Main : public CBase_Main {
 
   /// Method called on reduction to indicate end of compuatations
   void done() {
+#ifdef PARATREET_STATS
+    tpProxy.reportStats();
+#else
+    finish();
+#endif
+  }
+
+  /// Method called on reduction with the traversal counters of every PE
+  void statsReported(CkReductionMsg *m) {
+    PARATREET_STAT(ParaTreeT::reducedStats(m).print("[Main] Traversal statistics");)
+    delete m;
+    finish();
+  }
+
+  /// End of the run, first gathering the timeline of phases if tracing
+  void finish() {
     CkPrintf("[Main] Done with 1D Barnes-Hut computations\n");
+    if (tracing)
+      tpProxy.shareTrace();
+    else
+      CkExit();
+  }
+
+  /// Method called with the phases traced on every PE: write the timeline, then exit
+  void traceGathered(CkReductionMsg *m) {
+    int n = m->getSize()/sizeof(ParaTreeT::TraceEvent);
+    if (ParaTreeT::writeTrace(traceFile.c_str(), (ParaTreeT::TraceEvent *)m->getData(), n))
+      CkPrintf("[Main] Wrote %d traced phases to %s\n", n, traceFile.c_str());
+    delete m;
     CkExit();
   }
 
@@ -1,7 +1,14 @@
 #include "barnes1d_cputree.h"
+#include "paratreet_output.h"
+#include "paratreet_trace.h"
+#include <chrono>
 
 int main(int argc, char *argv[]){
 
+	//record phases for a timeline if PARATREET_TRACE names a file
+	const char *traceFile = ParaTreeT::traceFileFromEnv();
+	ParaTreeT::traceEnable(traceFile != NULL);
+
 	//depth of the binary tree
 	int depth = 3;
 	BarnesKey treeRoot=1;
@@ -11,20 +18,44 @@ int main(int argc, char *argv[]){
 
 	//recursively construct tree starting from the root
 	cout<<"*********BUILDING TREE*********\n";
-	t.constructNode(treeRoot, 0.0, 100.0);
+	{
+		PARATREET_TRACE_PHASE("build");
+		t.constructNode(treeRoot, 0.0, 100.0);
+	}
 
 	//traverse the tree starting from the root
 	DEBUG(cout<<"*********TRAVERSING TREE*********\n";)
 	DEBUG(t.printSubTree(treeRoot);)
 
 	DEBUG(cout<<"*********COMPUTING GRAVITY*********\n";)
-	//Iterate over all leaves and compute their gravity and print accelerations
+	//Iterate over all leaves and compute their gravity; each result is the leaf key and its acceleration
+	ParaTreeT::ResultBuffer results;
+	double total = 0.0;
+	double walkStart = ParaTreeT::traceBegin();
 	for(int i=0;i<t.size;i++){
 		//check if the node is a leaf
 		if(i>=pow(2,depth)){
 			BarnesConsumer<typeof(t),BarnesKey> c(t, t.node[i]);
 			t.requestKey(treeRoot, c);
-			cout<<"Particle "<<i<<" has an acceleration of "<<c.acc<<endl;
+			BarnesKey key = i;
+			results.put(key);
+			results.put(c.acc);
+			total += c.acc;
+		}
+	}
+	ParaTreeT::traceEnd("walk", walkStart);
+	cout<<"Total acceleration "<<total<<endl;
+	PARATREET_STAT(ParaTreeT::totalStats().print("Traversal statistics");)
+	//Write the results, timing the output on its own
+	if (argc >= 2) {
+		PARATREET_TRACE_PHASE("output");
+		auto t1 = std::chrono::high_resolution_clock::now();
+		if (ParaTreeT::writeResultFile(argv[1], results)) {
+			auto t2 = std::chrono::high_resolution_clock::now();
+			cout<<"Wrote "<<results.size()<<" bytes of results to "<<argv[1]<<" in "
+				<<std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count()<<" us"<<endl;
 		}
 	}
+	if (traceFile && ParaTreeT::writeTraceFile(traceFile))
+		cout<<"Wrote trace to "<<traceFile<<endl;
 }
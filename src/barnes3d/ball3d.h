@@ -0,0 +1,114 @@
+/**
+ * 3D fixed-radius ball search consumer, on the Barnes-Hut octree.
+ */
+#ifndef __PARATREET_BALL3D
+#define __PARATREET_BALL3D
+
+#include "barnes3d.h"
+
+/**
+ * Particles below each node of a dense octree, indexed by key, and the keys
+ * of the leaves holding them.  Massless leaves (the padding after the
+ * particles) hold none; the builds put them last, after endLeaf.
+ */
+template <class BarnesKey>
+struct BarnesNodeCounts {
+	std::vector<int> count;
+	BarnesKey firstLeaf, endLeaf; // leaves firstLeaf to endLeaf-1 hold the particles
+
+	/// Count the particles below every node of a tree of size keys
+	void compute(const BarnesNodeData *tree, BarnesKey size, BarnesKey first) {
+		firstLeaf = endLeaf = first;
+		count.assign(size, 0);
+		for (BarnesKey k = size - 1; k >= firstLeaf; k--) {
+			count[k] = (tree[k].mass > 0.0f) ? 1 : 0;
+			if (count[k] && endLeaf == firstLeaf) endLeaf = k + 1;
+		}
+		for (BarnesKey k = firstLeaf - 1; k >= 1; k--)
+			for (int i = 0; i < 8; i++)
+				count[k] += count[getChild(k, i)];
+	}
+
+	/// Keys of the particle leaves below a node, lo to hi-1: they are consecutive on the leaf level
+	inline void leafRange(BarnesKey key, BarnesKey &lo, BarnesKey &hi) const {
+		lo = hi = key;
+		while (lo < firstLeaf) {
+			lo = getChild(lo, 0);
+			hi = getChild(hi, 7);
+		}
+		hi = (hi + 1 < endLeaf) ? hi + 1 : endLeaf;
+	}
+};
+
+/// Neighbour output of a Ball3dConsumer that appends their keys to an array shared by many consumers
+template <class BarnesKey>
+struct Ball3dNeighborList {
+	std::vector<BarnesKey> *out;
+
+	Ball3dNeighborList(std::vector<BarnesKey> *out) :out(out) {}
+	inline void push_back(const BarnesKey &key) { out->push_back(key); }
+	/// Every particle below a node: the leaves lo to hi-1 (their count isn't needed)
+	inline void push_range(const BarnesKey &lo, const BarnesKey &hi, int) {
+		for (BarnesKey k = lo; k < hi; k++) out->push_back(k);
+	}
+};
+
+/// Neighbour output of a Ball3dConsumer that only counts them, whole nodes at a time
+template <class BarnesKey>
+struct Ball3dNeighborCounter {
+	long count;
+
+	CUDA_BOTH Ball3dNeighborCounter() :count(0) {}
+	inline CUDA_BOTH void push_back(const BarnesKey &) { count++; }
+	inline CUDA_BOTH void push_range(const BarnesKey &, const BarnesKey &, int n) { count += n; }
+};
+
+/**
+ * A 3D ball search consumer: finds the particles within radius of me,
+ * itself included.
+ *
+ * Nodes whose box misses the sphere are pruned.  Nodes whose box lies inside
+ * it are accepted whole, without being opened: a counting search adds their
+ * particle count, and a listing search adds the run of leaf keys below them.
+ * Only the nodes cut by the sphere are opened.
+ */
+template <class ParaTree,class BarnesKey,class Neighbors = Ball3dNeighborCounter<BarnesKey> >
+struct Ball3dConsumer {
+public:
+	ParaTree &tree;
+	const BarnesLeafData &me;
+	float radius2; // squared search radius
+	const BarnesNodeCounts<BarnesKey> &counts;
+	Neighbors neighbors;
+
+	CUDA_BOTH Ball3dConsumer(ParaTree &tree,const BarnesLeafData &me,float radius,
+			const BarnesNodeCounts<BarnesKey> &counts,const Neighbors &neighbors = Neighbors())
+		:tree(tree), me(me), radius2(radius*radius), counts(counts), neighbors(neighbors) {}
+
+	/// Consume a tree node: prunes it, takes it whole, or opens it if the sphere cuts it.
+	inline CUDA_BOTH void consumeNode(const BarnesNodeData &n, const BarnesKey &key) {
+		PARATREET_COUNT(STAT_NODES_VISITED, 1);
+		if (n.mass <= 0.0f || boxDistance2(me.pos, n.min, n.max) > radius2)
+			return; // empty, or outside the sphere
+		if (boxFarthest2(me.pos, n.min, n.max) <= radius2) { // inside the sphere
+			PARATREET_COUNT(STAT_NODE_INTERACTIONS, 1);
+			BarnesKey lo, hi;
+			counts.leafRange(key, lo, hi);
+			neighbors.push_range(lo, hi, counts.count[key]);
+			return;
+		}
+		TRACE_BARNES(printf("Me = (%6.2f, %6.2f, %6.2f), opening node %d\n", me.pos.x, me.pos.y, me.pos.z, key));
+		PARATREET_COUNT(STAT_NODES_OPENED, 1);
+		tree.requestChildren(key, *this);
+	}
+
+	/// Consume a tree leaf: a neighbour if it is inside the sphere.
+	inline CUDA_BOTH void consumeLeaf(const BarnesLeafData &l, const BarnesKey &key) {
+		PARATREET_COUNT(STAT_NODES_VISITED, 1);
+		PARATREET_COUNT(STAT_LEAF_INTERACTIONS, 1);
+		if (l.mass > 0.0f && distance2(me.pos, l.pos) <= radius2)
+			neighbors.push_back(key);
+	}
+};
+
+#endif
@@ -5,8 +5,11 @@
 #define __PARATREET_BARNES3D
 
 #include "paratreet.h"
+#include <algorithm>
 #include <cmath>
+#include <cfloat>
 #include <cstdlib>
+#include <vector>
 
 /**
  * Barnes-Hut key for tree nodes.
@@ -22,6 +25,43 @@ CUDA_BOTH inline BarnesKey getChild(ParaTree &t, BarnesKey parent, int index) {
   return getChild(parent, index);
 }
 
+/// Get parent of given key (the root has no parent)
+CUDA_BOTH inline BarnesKey getParent(BarnesKey child) {
+  return (child + 6) / 8;
+}
+
+/// Get index (0-7) of this key among its siblings
+CUDA_BOTH inline int getChildIndex(BarnesKey key) {
+  return (int)((key + 6) % 8);
+}
+
+/// Get the first key on this level of the tree (the root is level 0)
+CUDA_BOTH inline BarnesKey getLevelStart(int level) {
+  return (((BarnesKey)1 << (3*level)) - 1) / 7 + 1;
+}
+
+/// Get the level of the tree this key is on
+CUDA_BOTH inline int getLevel(BarnesKey key) {
+  int level = 0;
+  while (key >= getLevelStart(level + 1)) level++;
+  return level;
+}
+
+/// Get the depth of the shallowest tree with at least this many leaves
+inline int getDepthFor(long long leaves) {
+  int depth = 1;
+  while (((long long)1 << (3*(depth - 1))) < leaves) depth++;
+  return depth;
+}
+
+/**
+ * Keys are numbered level by level, so the offset of a key within its level
+ * spells out the path from the root, one octal digit (child index) per level.
+ */
+CUDA_BOTH inline BarnesKey getLevelOffset(BarnesKey key, int level) {
+  return key - getLevelStart(level);
+}
+
 /**
  * Struct for using 3d vectors.
  */
@@ -36,7 +76,7 @@ struct vector3d {
     x = x_; y = y_; z = z_;
   }
 
-  vector3d operator+(const vector3d& rhs) {
+  vector3d operator+(const vector3d& rhs) const {
     vector3d v;
     v.x = this->x + rhs.x;
     v.y = this->y + rhs.y;
@@ -44,7 +84,7 @@ struct vector3d {
     return v;
   }
 
-  vector3d operator-(const vector3d& rhs) {
+  vector3d operator-(const vector3d& rhs) const {
     vector3d v;
     v.x = this->x - rhs.x;
     v.y = this->y - rhs.y;
@@ -52,7 +92,7 @@ struct vector3d {
     return v;
   }
 
-  vector3d operator/(const int& div) {
+  vector3d operator/(const int& div) const {
     vector3d v;
     v.x = this->x / div;
     v.y = this->y / div;
@@ -60,7 +100,7 @@ struct vector3d {
     return v;
   }
 
-  vector3d operator*(const float& mul) {
+  vector3d operator*(const float& mul) const {
     vector3d v;
     v.x = this->x * mul;
     v.y = this->y * mul;
@@ -75,6 +115,42 @@ struct vector3d {
 #endif
 };
 
+/// Compute the box of the cell at this key, by splitting the root box down the key's path
+inline void getCellBox(BarnesKey key, vector3d rootMin, vector3d rootMax, vector3d &min, vector3d &max) {
+  int level = getLevel(key);
+  BarnesKey offset = getLevelOffset(key, level);
+  min = rootMin; max = rootMax;
+  for (int l = level - 1; l >= 0; l--) {
+    int index = (int)((offset >> (3*l)) & 7);
+    vector3d mid = (min+max)/2;
+    if (index & 1) min.x = mid.x; else max.x = mid.x;
+    if (index & 2) min.y = mid.y; else max.y = mid.y;
+    if (index & 4) min.z = mid.z; else max.z = mid.z;
+  }
+}
+
+/// Squared distance from a point to the nearest point of the box [min,max] (zero inside it)
+CUDA_BOTH inline float boxDistance2(const vector3d &p, const vector3d &min, const vector3d &max) {
+	float dx = fmaxf(0.0f, fmaxf(min.x - p.x, p.x - max.x));
+	float dy = fmaxf(0.0f, fmaxf(min.y - p.y, p.y - max.y));
+	float dz = fmaxf(0.0f, fmaxf(min.z - p.z, p.z - max.z));
+	return dx*dx + dy*dy + dz*dz;
+}
+
+/// Squared distance from a point to the farthest corner of the box [min,max]
+CUDA_BOTH inline float boxFarthest2(const vector3d &p, const vector3d &min, const vector3d &max) {
+	float dx = fmaxf(p.x - min.x, max.x - p.x);
+	float dy = fmaxf(p.y - min.y, max.y - p.y);
+	float dz = fmaxf(p.z - min.z, max.z - p.z);
+	return dx*dx + dy*dy + dz*dz;
+}
+
+/// Squared distance between two points
+CUDA_BOTH inline float distance2(const vector3d &a, const vector3d &b) {
+	float dx = a.x - b.x, dy = a.y - b.y, dz = a.z - b.z;
+	return dx*dx + dy*dy + dz*dz;
+}
+
 /**
  * A Barnes-Hut leaf: a particle (or list of particles).
  */
@@ -121,48 +197,327 @@ public:
     BarnesLeafData(mass, pos), min(min), max(max) {}
 };
 
+/// Start accumulating the moments of an interior node
+inline BarnesNodeData emptyMoments() {
+  return BarnesNodeData(0.0, vector3d(0.0, 0.0, 0.0),
+      vector3d(FLT_MAX, FLT_MAX, FLT_MAX), vector3d(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+}
+
+/// Add a child's moments to a node (pos holds the mass-weighted sum until finishMoments)
+inline void addMoments(BarnesNodeData &n, const BarnesNodeData &child) {
+  n.mass += child.mass;
+  n.pos = n.pos + child.pos*child.mass;
+  n.min = vector3d(fminf(n.min.x, child.min.x), fminf(n.min.y, child.min.y), fminf(n.min.z, child.min.z));
+  n.max = vector3d(fmaxf(n.max.x, child.max.x), fmaxf(n.max.y, child.max.y), fmaxf(n.max.z, child.max.z));
+}
+
+/// Turn the accumulated mass-weighted position into the center of mass
+/// (a massless node sits at the center of its box, so walks never open it)
+inline void finishMoments(BarnesNodeData &n) {
+  if (n.mass > 0.0f) n.pos = n.pos*(1.0f/n.mass);
+  else n.pos = (n.min + n.max)/2;
+}
+
+/// Spread the low 21 bits of v out to every third bit
+inline unsigned long long spreadBits(unsigned long long v) {
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffull;
+  v = (v | v << 16) & 0x1f0000ff0000ffull;
+  v = (v | v << 8) & 0x100f00f00f00f00full;
+  v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+  v = (v | v << 2) & 0x1249249249249249ull;
+  return v;
+}
+
+/// Morton (Z-order) key of a position in a box, 21 bits per axis
+inline unsigned long long getMortonKey(vector3d pos, vector3d min, vector3d max) {
+  unsigned long long k[3];
+  float p[3] = {pos.x, pos.y, pos.z}, lo[3] = {min.x, min.y, min.z}, hi[3] = {max.x, max.y, max.z};
+  for (int a = 0; a < 3; a++) {
+    float f = (hi[a] > lo[a]) ? (p[a] - lo[a])/(hi[a] - lo[a]) : 0.0f;
+    k[a] = (unsigned long long)(fminf(fmaxf(f, 0.0f), 1.0f)*0x1fffff);
+  }
+  return spreadBits(k[0]) | spreadBits(k[1]) << 1 | spreadBits(k[2]) << 2;
+}
+
+/// Bounding box of the positions of n leaves (n > 0)
+inline void leafBounds(const BarnesNodeData *leaves, int n, vector3d &min, vector3d &max) {
+  min = leaves[0].pos;
+  max = leaves[0].pos;
+  for (int i = 1; i < n; i++) {
+    min = vector3d(fminf(min.x, leaves[i].pos.x), fminf(min.y, leaves[i].pos.y), fminf(min.z, leaves[i].pos.z));
+    max = vector3d(fmaxf(max.x, leaves[i].pos.x), fmaxf(max.y, leaves[i].pos.y), fmaxf(max.z, leaves[i].pos.z));
+  }
+}
+
+/**
+ * Sort leaves (and their velocities, unless vel is NULL) into Morton order
+ * within the box min to max, so consecutive leaves, and so the subtrees above
+ * them, hold nearby particles.
+ */
+inline void sortLeavesMorton(BarnesNodeData *leaves, vector3d *vel, int n, vector3d min, vector3d max) {
+  if (n <= 1) return;
+  std::vector<std::pair<unsigned long long, int> > order(n);
+  for (int i = 0; i < n; i++)
+    order[i] = std::make_pair(getMortonKey(leaves[i].pos, min, max), i);
+  std::sort(order.begin(), order.end());
+  std::vector<BarnesNodeData> sortedLeaves(n);
+  for (int i = 0; i < n; i++) sortedLeaves[i] = leaves[order[i].second];
+  std::copy(sortedLeaves.begin(), sortedLeaves.end(), leaves);
+  if (vel) {
+    std::vector<vector3d> sortedVel(n);
+    for (int i = 0; i < n; i++) sortedVel[i] = vel[order[i].second];
+    std::copy(sortedVel.begin(), sortedVel.end(), vel);
+  }
+}
+
+/// Sort leaves into Morton order within their own bounding box
+inline void sortLeavesMorton(BarnesNodeData *leaves, vector3d *vel, int n) {
+  if (n <= 1) return;
+  vector3d min, max;
+  leafBounds(leaves, n, min, max);
+  sortLeavesMorton(leaves, vel, n, min, max);
+}
+
+/**
+ * Snapshot sink (see ParaTreeT::SnapshotReader) that writes particles first,
+ * first+1, ... into consecutive leaves, as nodes of zero extent, and their
+ * velocities into vel if it isn't NULL.
+ */
+struct BarnesLeafSink {
+  BarnesNodeData *leaves;
+  vector3d *vel;
+  long long first;
+  int filled; // leaves written so far
+
+  BarnesLeafSink(BarnesNodeData *leaves, vector3d *vel, long long first)
+    :leaves(leaves), vel(vel), first(first), filled(0) {}
+
+  inline void particle(long long i, float mass, const float *p, const float *v) {
+    vector3d pos(p[0], p[1], p[2]);
+    leaves[i - first] = BarnesNodeData(mass, pos, pos, pos);
+    if (vel) vel[i - first] = vector3d(v[0], v[1], v[2]);
+    filled++;
+  }
+
+  /// Fill the leaves after the particles, up to n, with massless copies of the last
+  /// particle (or of this point if there was none), so they change no moments
+  void pad(int n, vector3d where) {
+    if (filled > 0) where = leaves[filled - 1].pos;
+    for (int i = filled; i < n; i++) {
+      leaves[i] = BarnesNodeData(0.0, where, where, where);
+      if (vel) vel[i] = vector3d(0.0, 0.0, 0.0);
+    }
+  }
+};
+
+/**
+ * Frame for packing the coordinates of a node: the cell box of its key,
+ * grown 2^scale times about its center so the node fits inside.
+ * Each axis is cut into 65535 fixed-point steps.
+ */
+struct BarnesPackFrame {
+  vector3d lo, width;
+
+  BarnesPackFrame(BarnesKey key, vector3d rootMin, vector3d rootMax, int scale) {
+    vector3d min, max;
+    getCellBox(key, rootMin, rootMax, min, max);
+    width = (max - min)*ldexpf(1.0f, scale);
+    lo = (min + max)/2 - width*0.5f;
+  }
+
+  /// Does the frame hold the box [min,max]?
+  inline bool holds(vector3d min, vector3d max) const {
+    vector3d hi = lo + width;
+    return min.x >= lo.x && min.y >= lo.y && min.z >= lo.z && max.x <= hi.x && max.y <= hi.y && max.z <= hi.z;
+  }
+
+  /// Smallest scale whose frame around this key holds the box [min,max]
+  static int fit(BarnesKey key, vector3d rootMin, vector3d rootMax, vector3d min, vector3d max) {
+    int scale = 0;
+    if (min.x > max.x) return scale; // empty box
+    while (scale < 64 && !BarnesPackFrame(key, rootMin, rootMax, scale).holds(min, max)) scale++;
+    return scale;
+  }
+
+  /// Fixed-point value of v on one axis: rounded to nearest (0), down (-1) or up (+1)
+  static inline unsigned short pack(float v, float lo, float width, int rounding) {
+    float t = (v - lo)/width*65535.0f;
+    t = (rounding < 0) ? floorf(t) : (rounding > 0) ? ceilf(t) : floorf(t + 0.5f);
+    return (unsigned short)fminf(fmaxf(t, 0.0f), 65535.0f);
+  }
+
+  static inline float unpack(unsigned short q, float lo, float width) {
+    return lo + q*(width/65535.0f);
+  }
+
+  inline void pack(vector3d v, int rounding, unsigned short *q) const {
+    q[0] = pack(v.x, lo.x, width.x, rounding);
+    q[1] = pack(v.y, lo.y, width.y, rounding);
+    q[2] = pack(v.z, lo.z, width.z, rounding);
+  }
+
+  inline vector3d unpack(const unsigned short *q) const {
+    return vector3d(unpack(q[0], lo.x, width.x), unpack(q[1], lo.y, width.y), unpack(q[2], lo.z, width.z));
+  }
+};
+
+/**
+ * A leaf packed for the wire: 12 bytes instead of 16.
+ * mass is exact; pos is within about half a step (frame width/65535) on each axis.
+ */
+class BarnesPackedLeaf {
+public:
+  float mass;
+  unsigned short pos[3];
+  signed char scale;
+
+#ifdef __CHARMC__
+  void pup(PUP::er &p) {
+    p|mass;
+    PUParray(p, pos, 3);
+    p|scale;
+  }
+#endif
+
+  BarnesPackedLeaf() {}
+
+  BarnesPackedLeaf(const BarnesLeafData &l, BarnesKey key, vector3d rootMin, vector3d rootMax) : mass(l.mass) {
+    scale = BarnesPackFrame::fit(key, rootMin, rootMax, l.pos, l.pos);
+    BarnesPackFrame(key, rootMin, rootMax, scale).pack(l.pos, 0, pos);
+  }
+
+  BarnesLeafData unpack(BarnesKey key, vector3d rootMin, vector3d rootMax) const {
+    return BarnesLeafData(mass, BarnesPackFrame(key, rootMin, rootMax, scale).unpack(pos));
+  }
+};
+
+/**
+ * A node packed for the wire: 24 bytes instead of 40.
+ * mass is exact; pos is within about half a step (frame width/65535) on each axis;
+ * min and max are rounded outward, by about a step at most, so the unpacked box
+ * still holds every particle below the node.
+ */
+class BarnesPackedNode {
+public:
+  float mass;
+  unsigned short pos[3], min[3], max[3];
+  signed char scale;
+
+#ifdef __CHARMC__
+  void pup(PUP::er &p) {
+    p|mass;
+    PUParray(p, pos, 3);
+    PUParray(p, min, 3);
+    PUParray(p, max, 3);
+    p|scale;
+  }
+#endif
+
+  BarnesPackedNode() {}
+
+  BarnesPackedNode(const BarnesNodeData &n, BarnesKey key, vector3d rootMin, vector3d rootMax) : mass(n.mass) {
+    scale = BarnesPackFrame::fit(key, rootMin, rootMax, n.min, n.max);
+    BarnesPackFrame frame(key, rootMin, rootMax, scale);
+    frame.pack(n.pos, 0, pos);
+    frame.pack(n.min, -1, min);
+    frame.pack(n.max, +1, max);
+  }
+
+  BarnesNodeData unpack(BarnesKey key, vector3d rootMin, vector3d rootMax) const {
+    BarnesPackFrame frame(key, rootMin, rootMax, scale);
+    return BarnesNodeData(mass, frame.unpack(pos), frame.unpack(min), frame.unpack(max));
+  }
+};
+
+/// Default opening threshold of BarnesConsumer: nodes that look bigger than this (radius/distance) are opened
+CUDA_BOTH inline float barnesOpeningThreshold() { return 0.8f; }
+
+/// Precision policies for the accumulators of BarnesConsumer and BarnesAccelerations
+struct BarnesFloatAccumulators { typedef float Real; };
+struct BarnesDoubleAccumulators { typedef double Real; };
+
 /**
  * A Barnes-Hut tree data consumer: computes gravity on nodes and leaves of the tree.
+ * The acceleration and potential are summed in the Real type of the Precision policy.
  */
-template <class ParaTree,class BarnesKey>
+template <class ParaTree,class BarnesKey,class Precision = BarnesFloatAccumulators>
 struct BarnesConsumer {
 public:
+	typedef typename Precision::Real Real;
 	ParaTree &tree;
 	const BarnesLeafData &me;
-	float acc;
+	Real ax, ay, az; // acceleration vector
+	Real phi; // potential, per unit mass
+	int interactions; // number of nodes and leaves whose gravity was added
+	float openingThreshold;
+	BarnesKey bucketStart; // nodes from this key on are below bucket roots, and always opened
 
-	CUDA_BOTH BarnesConsumer(ParaTree &tree,const BarnesLeafData &me) 
-		:tree(tree), me(me) 
+	/**
+	 A consumer opening nodes that look bigger than openingThreshold.  The nodes
+	 on level bucketLevel act as buckets: once one is opened, all its particles
+	 are summed directly (by default, the tree has no buckets).
+	*/
+	CUDA_BOTH BarnesConsumer(ParaTree &tree,const BarnesLeafData &me,
+			float openingThreshold = barnesOpeningThreshold(), int bucketLevel = -1)
+		:tree(tree), me(me), openingThreshold(openingThreshold),
+		 bucketStart(bucketLevel >= 0 ? getLevelStart(bucketLevel + 1) : ~(BarnesKey)0)
 	{
-		acc=0.0f;
+		ax=ay=az=0;
+		phi=0;
+		interactions=0;
+	}
+
+/// Packing-unpacking of the accumulated state; tree and me are rebound by the owner
+#ifdef __CHARMC__
+	void pup(PUP::er &p) {
+		p|ax; p|ay; p|az;
+		p|phi;
+		p|interactions;
+		p|openingThreshold;
+		p|bucketStart;
+	}
+#endif
+
+	/// Acceleration vector, rounded to float
+	inline CUDA_BOTH vector3d accel() const {
+		return vector3d(ax, ay, az);
 	}
 
 	/// Add gravity from this object (node or leaf)
 	inline CUDA_BOTH void addGravity(const BarnesLeafData &l) {
-		float G = 1.0;
-		float SOFTENING = 0.00001; // force softening, to avoid divide by zero when evaluating self forces
-		float r = sqrt(pow(l.pos.x - me.pos.x,2) + pow(l.pos.y - me.pos.y,2) + pow(l.pos.z - me.pos.z,2));
-		float r3 = (abs(r*r*r)+SOFTENING);
-		float fm = G*l.mass*r/r3; // force divided by my mass
+		Real G = 1.0;
+		Real SOFTENING = 0.00001; // force softening, to avoid divide by zero when evaluating self forces
+		Real dx = l.pos.x - me.pos.x, dy = l.pos.y - me.pos.y, dz = l.pos.z - me.pos.z;
+		Real r2 = dx*dx + dy*dy + dz*dz;
+		Real r = sqrt(r2);
+		Real r3 = r2*r + SOFTENING;
+		Real gm = G*l.mass/r3;
 		TRACE_BARNES(printf("   gravity on (%6.2f, %6.2f, %6.2f) from (%6.2f, %6.2f, %6.2f) = %.3g (r3=%.2f)\n",
-          me.pos.x, me.pos.y, me.pos.z, l.pos.x, l.pos.y, l.pos.z, fm, r3));
-		acc += fm;
+          me.pos.x, me.pos.y, me.pos.z, l.pos.x, l.pos.y, l.pos.z, (double)(gm*r), (double)r3));
+		ax += gm*dx;
+		ay += gm*dy;
+		az += gm*dz;
+		phi -= gm*r2; // -G*m/r, softened like the force (and zero for ourselves)
+		interactions++;
 	}
 	
 	/// Consume a tree node: recursively opens the node if nearby, or lumps it if distant.
 	inline CUDA_BOTH void consumeNode(const BarnesNodeData &n, const BarnesKey &key) { 
+		PARATREET_COUNT(STAT_NODES_VISITED, 1);
 		float radius = sqrt(pow(n.max.x - n.pos.x,2) + pow(n.max.y - n.pos.y,2) + pow(n.max.z - n.pos.z,2));
 		float distance = sqrt(pow(me.pos.x - n.pos.x,2) + pow(me.pos.y - n.pos.y,2) + pow(me.pos.z - n.pos.z,2));
 		float angularSize = radius/abs(distance);
-		float openingThreshold = 0.8;
 		
-		if (angularSize > openingThreshold) { // open recursively
+		if (angularSize > openingThreshold || key >= bucketStart) { // open recursively
 			TRACE_BARNES(printf("Me = (%6.2f, %6.2f, %6.2f), opening node %d (angular %.2f)\n",
             me.pos.x, me.pos.y, me.pos.z, key, angularSize));
+			PARATREET_COUNT(STAT_NODES_OPENED, 1);
 			tree.requestChildren(key, *this);
 		} else { // compute acceleration to lumped centroid
 			TRACE_BARNES(printf("Me = (%6.2f, %6.2f, %6.2f), lumping gravity from (%6.2f, %6.2f, %6.2f) (angular %.2f)\n",
             me.pos.x, me.pos.y, me.pos.z, n.pos.x, n.pos.y, n.pos.z, angularSize));
+			PARATREET_COUNT(STAT_NODE_INTERACTIONS, 1);
 			addGravity(n);
 		}
 	}
@@ -171,9 +526,47 @@ public:
 	inline CUDA_BOTH void consumeLeaf(const BarnesLeafData &l, const BarnesKey &key) { 
 		TRACE_BARNES(printf("Me = (%6.2f, %6.2f, %6.2f), leaf gravity from (%6.2f, %6.2f, %6.2f)\n",
           me.pos.x, me.pos.y, me.pos.z, l.pos.x, l.pos.y, l.pos.z));
+		PARATREET_COUNT(STAT_NODES_VISITED, 1);
+		PARATREET_COUNT(STAT_LEAF_INTERACTIONS, 1);
 		addGravity(l);
 	}
 	
 };
 
+/**
+ * Accelerations and potentials of a set of particles, as SoA arrays.
+ */
+template <class Real>
+struct BarnesAccelerations {
+	std::vector<Real> ax, ay, az, phi;
+
+	BarnesAccelerations(size_t n = 0) { resize(n); }
+
+	size_t size() const { return ax.size(); }
+
+	void resize(size_t n) {
+		ax.assign(n, 0); ay.assign(n, 0); az.assign(n, 0);
+		phi.assign(n, 0);
+	}
+
+	/// Store the result of a finished consumer as particle i
+	template <class Consumer>
+	void store(size_t i, const Consumer &c) {
+		ax[i] = c.ax; ay[i] = c.ay; az[i] = c.az;
+		phi[i] = c.phi;
+	}
+
+	/// Magnitude of the acceleration of particle i
+	double magnitude(size_t i) const {
+		return sqrt((double)ax[i]*ax[i] + (double)ay[i]*ay[i] + (double)az[i]*az[i]);
+	}
+
+	/// Relative error of the acceleration of particle i, against particle j of a reference
+	template <class R>
+	double error(size_t i, const BarnesAccelerations<R> &ref, size_t j) const {
+		double dx = ax[i] - (double)ref.ax[j], dy = ay[i] - (double)ref.ay[j], dz = az[i] - (double)ref.az[j];
+		return sqrt(dx*dx + dy*dy + dz*dz)/ref.magnitude(j);
+	}
+};
+
 #endif
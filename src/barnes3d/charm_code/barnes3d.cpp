@@ -1,9 +1,22 @@
 #include "pup.h"
+#include "pup_stl.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <list>
+#include <map>
+#include <vector>
 using namespace std;
 #include "barnes3d.h"
+#include "knn3d.h"
+#include "paratreet_cache.h"
+#include "paratreet_snapshot.h"
+#include "paratreet_trace.h"
+#include "completion.h"
+
 #include "barnes.decl.h"
 
 /// Define DEBUG(x) to x if you need to print out a lot of statements
@@ -12,71 +25,927 @@ using namespace std;
 
 /* readonly */ CProxy_Main mainProxy;
 /* readonly */ CProxy_BarnesTreePiece tpProxy;
+/* readonly */ int treeDepth;  // number of levels in the tree
+/* readonly */ int pieceLevel; // level whose nodes are the roots of the tree pieces
+/* readonly */ int replicatedLevels; // number of top levels replicated on every PE
+/* readonly */ CProxy_BarnesNodeCache cacheProxy;
+/* readonly */ float timeStep; // leapfrog time step
+/* readonly */ int cacheSize; // remote nodes cached per process
+/* readonly */ bool prefetch; // fetch the remote nodes each piece will likely need before walking
+/* readonly */ bool tracing; // record a timeline of phases on every PE
+/* readonly */ int neighborCount; // nearest neighbours each particle looks for, if any
+/* readonly */ CProxy_CompletionDetector exchangeDetector; // counts the runs of the snapshot exchange in flight
+
+/// Box containing all the particles: this one for generated particles, or the bounds
+/// of a snapshot's particles once they are read, set on every process by BarnesNodeCache::setRoot
+vector3d rootMin(0.0, 0.0, 0.0);
+vector3d rootMax(100.0, 100.0, 100.0);
+
+/// Opening threshold used by BarnesConsumer, for the prefetch walk
+static const float prefetchThreshold = barnesOpeningThreshold();
+
+/// Walks over the tree that can be in flight at once, each with its own consumers and completion detector
+enum WalkType { GRAVITY_WALK = 0, KNN_WALK, NUM_WALK_TYPES };
+
+/// Scheduler priorities (smaller runs first): remote requests and replies unblock
+/// stalled consumers, so they go ahead of the next chunk of local walk work
+static const int remotePriority = -1;
+static const int walkPriority = 1;
+
+/// Number of consumers walked before a piece yields to the scheduler
+static const int walkChunk = 64;
+
+/// Entry options for a message sent at this priority
+inline CkEntryOptions prioritized(int priority) {
+  CkEntryOptions opts;
+  opts.setPriority(priority);
+  return opts;
+}
+
+/// Walk time of the pieces on this PE during the current step.  The first of them
+/// to report its cost takes it, so every PE's load is counted once.
+inline double &peWalkTime() {
+  static thread_local double time = 0.0;
+  return time;
+}
+
+/// Index of the piece owning a key: a piece owns the subtree below its node
+/// on the piece level, plus the top-level nodes whose leftmost descendant it holds.
+inline int ownerOf(BarnesKey key) {
+  int level = getLevel(key);
+  BarnesKey offset = getLevelOffset(key, level);
+  if (level >= pieceLevel)
+    return (int)(offset >> (3*(level - pieceLevel)));
+  else
+    return (int)(offset << (3*(pieceLevel - level)));
+}
+
+/// Is this global key a leaf of the tree?
+inline bool isLeafKey(BarnesKey key) {
+  return key >= getLevelStart(treeDepth - 1);
+}
+
+/// Keys each piece samples from its snapshot slice, for choosing where the pieces' shares split
+static const int keySamples = 16;
+
+/// A node on the replicated top levels, as contributed to the gather reduction
+struct TopEntry {
+  BarnesKey key;
+  BarnesNodeData node;
+};
+
+/// Particles a piece holds after the first round of the snapshot exchange, as contributed to their gather
+struct HeldCount {
+  int piece;
+  long long count;
+};
+
+/// Delta-encode ascending keys into bytes, 7 bits per byte, for key lists on the wire
+inline std::vector<unsigned char> encodeKeys(const std::vector<BarnesKey> &keys) {
+  std::vector<unsigned char> bytes;
+  BarnesKey last = 0;
+  for (int i = 0; i < keys.size(); i++) {
+    BarnesKey delta = keys[i] - last;
+    last = keys[i];
+    for (; delta >= 0x80; delta >>= 7)
+      bytes.push_back((unsigned char)(delta | 0x80));
+    bytes.push_back((unsigned char)delta);
+  }
+  return bytes;
+}
+
+/// Decode a key list made by encodeKeys
+inline std::vector<BarnesKey> decodeKeys(const std::vector<unsigned char> &bytes) {
+  std::vector<BarnesKey> keys;
+  BarnesKey last = 0;
+  for (int i = 0; i < bytes.size(); ) {
+    BarnesKey delta = 0;
+    for (int shift = 0; ; shift += 7) {
+      unsigned char b = bytes[i++];
+      delta |= (BarnesKey)(b & 0x7f) << shift;
+      if (!(b & 0x80)) break;
+    }
+    last += delta;
+    keys.push_back(last);
+  }
+  return keys;
+}
+
+class BarnesTreePiece;
+
+/**
+ * Per-process tree data, shared read-only by all the worker PEs of an SMP node:
+ * the replica of the top levels, the remote nodes fetched so far, and
+ * the tree pieces living in this process.
+ * Walks serve replicated keys from here instead of sending messages
+ * to the few pieces owning them.
+ */
+class BarnesNodeCache : public CBase_BarnesNodeCache {
+  public:
+    /// Replicated nodes, indexed by key
+    std::vector<BarnesNodeData> nodes;
+
+    /// Remote nodes fetched by any PE of this process during the current walk
+    ParaTreeT::NodeCache<BarnesKey, BarnesNodeData> remote;
+
+    /// Tree pieces in this process, indexed by piece (NULL if elsewhere)
+    std::vector<std::atomic<BarnesTreePiece *> > pieces;
+
+    /// Snapshot the particles are read from, mapped once per process (NULL to make up particles)
+    ParaTreeT::SnapshotReader *snapshot;
+
+    BarnesNodeCache(const std::string &snapshotFile) : remote(cacheSize), pieces(1 << (3*pieceLevel)), snapshot(NULL) {
+      ParaTreeT::traceEnable(tracing);
+      for (int i = 0; i < pieces.size(); i++)
+        pieces[i].store(NULL);
+      if (!snapshotFile.empty())
+        snapshot = new ParaTreeT::SnapshotReader(snapshotFile.c_str());
+    }
+
+    ~BarnesNodeCache() {
+      delete snapshot;
+    }
+
+    /// Is this key replicated here?
+    inline bool has(BarnesKey key) const {
+      return key < nodes.size();
+    }
+
+    /// The piece with this index, if it lives in this process
+    inline BarnesTreePiece *localPiece(int index) const {
+      return pieces[index].load(std::memory_order_acquire);
+    }
+
+    inline void registerPiece(int index, BarnesTreePiece *p) {
+      pieces[index].store(p, std::memory_order_release);
+    }
+
+    /// Post entry method: the replicated levels are received straight into our replica
+    void receiveTop(int &n, BarnesNodeData *&top, CkNcpyBufferPost *ncpyPost) {
+      nodes.resize(n);
+      top = nodes.data();
+      ncpyPost[0].regMode = CK_BUFFER_REG;
+    }
+
+    /// Entry method called with the bounds of the snapshot's particles: our root box
+    void setRoot(const vector3d &min, const vector3d &max) {
+      rootMin = min;
+      rootMax = max;
+      contribute(CkCallback(CkReductionTarget(Main, rootSet), mainProxy));
+    }
+
+    /// Entry method called with the replicated levels after each build
+    void receiveTop(int n, BarnesNodeData *top) {
+      PARATREET_TRACE_PHASE("receive top");
+      remote.clear(); // nodes fetched before the refit are stale
+      contribute(CkCallback(CkReductionTarget(Main, topReplicated), mainProxy));
+    }
+};
 
 /**
- * Trivial Barnes TreePiece.
- * Each TreePiece stores a single tree node (either internal node or leaf).
+ * Barnes TreePiece.
+ * Each TreePiece builds and stores the subtree below one node of the piece level.
+ * The top levels above it are assembled by sending finished moments up the tree.
 */
 class BarnesTreePiece : public CBase_BarnesTreePiece {
   public:
-    /// Tree node (1 node for 1 tree piece)
-    BarnesNodeData node;
+    /// Accelerations are summed in double, as they drive the integration
+    typedef BarnesConsumer<BarnesTreePiece, BarnesKey, BarnesDoubleAccumulators> LeafConsumer;
+    typedef KnnConsumer<BarnesTreePiece, BarnesKey> NeighborConsumer;
 
-    /// Consumer (only initialized for a leaf)
-    BarnesConsumer<BarnesTreePiece, BarnesKey> *cons;
+    /// Local subtree, stored in a dense array indexed by local key (local root is 1)
+    std::vector<BarnesNodeData> local;
 
-    /// Index of the first leaf
-    BarnesKey firstLeaf;
+    /// Number of levels in the local subtree
+    int localDepth;
 
-    /// Size of the tree
-    BarnesKey treeSize;
+    /// Local key of the first local leaf
+    BarnesKey localFirstLeaf;
 
-    /// Counter to keep a track of number of remote node requests sent
-    int remoteCounter = 0;
+    /// Top-level nodes owned by this piece, and how many of their children have reported
+    std::map<BarnesKey, BarnesNodeData> top;
+    std::map<BarnesKey, int> topChildren;
 
-    BarnesTreePiece(BarnesNodeData tpnode, BarnesKey firstLeaf, BarnesKey treeSize) : node(tpnode), firstLeaf(firstLeaf), treeSize(treeSize) {
-      /// Create a constructor only if the node is a leaf
-      if (thisIndex >= firstLeaf)
-        cons = new BarnesConsumer<BarnesTreePiece, BarnesKey>(*this, node);
+    /// Consumers (one for each local leaf)
+    std::vector<LeafConsumer> consumers;
+
+    /// Nearest neighbour consumers (one for each local particle, if neighborCount > 0)
+    std::vector<NeighborConsumer> neighborConsumers;
+
+    /// Tree data shared by the PEs of this process
+    BarnesNodeCache *nodeCache = NULL;
+
+    /// Progress of one walk on this piece.  Remote requests in flight are counted
+    /// by the walk's completion detector: produced when sent, consumed once answered.
+    struct WalkProgress {
+      int next;    // next consumer to start; all have started once it reaches their count
+      bool running;
+    };
+    WalkProgress walks[NUM_WALK_TYPES];
+
+    /// A remote node request waiting for its reply.  Replies only carry the
+    /// ticket (the request's index here), so the key, walk and consumer stay off the wire.
+    struct RemoteRequest {
+      BarnesKey key;
+      int walk, consIndex;
+    };
+    std::vector<RemoteRequest> requests;
+    std::vector<int> freeTickets; // entries of requests not in use
+    // Every request is answered before the step ends, so neither is packed for migration
+
+    /// Completion detector of each walk type for the current iteration
+    std::vector<CProxy_CompletionDetector> detectors;
+
+    /// Number of prefetch replies still expected before the walks can start
+    int prefetchPending = 0;
+
+    /// Keys requested from each owner by the prefetch, and the buffers their replies land in
+    std::map<int, std::vector<BarnesKey> > prefetchKeys;
+    std::map<int, std::vector<BarnesPackedNode> > prefetchNodes;
+
+    /// Velocities of the local particles, and whether they drifted since the last walk
+    std::vector<vector3d> vel;
+    bool drifted = false;
+
+    /// Snapshot exchange: the slice this piece read, the runs other pieces sent us from
+    /// theirs, then those runs merged in key order, to be sent on into the pieces' leaves
+    struct ExchangeRun {
+      std::vector<BarnesNodeData> nodes;
+      std::vector<vector3d> vel;
+    };
+    std::vector<BarnesNodeData> sliceNodes, heldNodes;
+    std::vector<vector3d> sliceVel, heldVel;
+    std::list<ExchangeRun> runs;
+    long long shareReceived = 0; // particles of our share landed so far, -1 once complete
+    int heldSending = 0; // buffers of runs sent from heldNodes and heldVel not yet delivered
+
+    /// Cost of this step's walk: time spent in walk entry methods (serving other pieces included),
+    /// and gravity interactions.  Reset once finishStep has reported them.
+    double walkTime = 0.0;
+    int interactions = 0;
+
+    /// Charge time spent in a walk entry method to this piece and its PE
+    inline void addWalkTime(double time) {
+      walkTime += time;
+      peWalkTime() += time;
     }
 
-    /// Check if all remote requests have completed
-    void checkDone() {
-      if (remoteCounter == 0) {
-        DEBUG(CkPrintf("[%d]remoteCounter == 0\n", thisIndex);)
-        if (thisIndex >= firstLeaf){
-          MYDEBUG(CkPrintf("[%d] Acceleration of particle : %f\n", thisIndex, cons->acc);)
+    BarnesTreePiece() {
+      usesAtSync = true;
+      for (int w = 0; w < NUM_WALK_TYPES; w++)
+        walks[w].running = false;
+      localDepth = treeDepth - pieceLevel;
+      local.resize(getLevelStart(localDepth));
+      localFirstLeaf = getLevelStart(localDepth - 1);
+      nodeCache = cacheProxy.ckLocalBranch();
+      nodeCache->registerPiece(thisIndex, this);
+    }
+
+    BarnesTreePiece(CkMigrateMessage *m) : CBase_BarnesTreePiece(m) {}
+
+    /// Packing-unpacking function needed for migrations in Charm++
+    void pup(PUP::er &p) {
+      p|localDepth;
+      p|localFirstLeaf;
+      p|local;
+      p|top;
+      p|topChildren;
+      p|vel;
+      p|drifted;
+      p((char *)walks, sizeof(walks));
+      p|walkTime;
+      p|interactions;
+      // Consumers refer to this piece and its leaves, so they are rebuilt rather than copied
+      int nConsumers = consumers.size();
+      p|nConsumers;
+      if (p.isUnpacking()) {
+        nodeCache = cacheProxy.ckLocalBranch();
+        nodeCache->registerPiece(thisIndex, this);
+        if (nConsumers > 0) makeConsumers();
+      }
+      for (int i = 0; i < nConsumers; i++)
+        p|consumers[i];
+      for (int i = 0; i < neighborConsumers.size(); i++)
+        p|neighborConsumers[i];
+    }
+
+    /// Leaving this process: other pieces here must message us again
+    void ckAboutToMigrate() {
+      nodeCache->registerPiece(thisIndex, NULL);
+    }
+
+    /// Global key of a node in the local subtree
+    BarnesKey globalKey(BarnesKey localKey) {
+      int level = getLevel(localKey);
+      return getLevelStart(pieceLevel + level) + ((BarnesKey)thisIndex << (3*level))
+        + getLevelOffset(localKey, level);
+    }
+
+    /// Local key of a global key below the piece level owned by this piece
+    BarnesKey localKey(BarnesKey key) const {
+      int level = getLevel(key) - pieceLevel;
+      BarnesKey offset = getLevelOffset(key, pieceLevel + level);
+      return getLevelStart(level) + (offset & (((BarnesKey)1 << (3*level)) - 1));
+    }
+
+    /// Find a node owned by this piece.  Read-only, so other PEs of this process may call it.
+    const BarnesNodeData *lookupNode(BarnesKey bk) const {
+      if (getLevel(bk) < pieceLevel) {
+        std::map<BarnesKey, BarnesNodeData>::const_iterator it = top.find(bk);
+        return (it == top.end()) ? NULL : &it->second;
+      }
+      return &local[localKey(bk)];
+    }
+
+    /// Create our particles in the leaves of the local subtree, then build the tree above them
+    void build() {
+      double start = ParaTreeT::traceBegin();
+      vel.assign(local.size() - localFirstLeaf, vector3d(0.0, 0.0, 0.0));
+      if (nodeCache->snapshot) {
+        readParticles(*nodeCache->snapshot); // the tree is built once the particles are exchanged
+        ParaTreeT::traceEnd("build", start);
+        return;
+      }
+      srand(thisIndex + 1);
+      for (BarnesKey lk = localFirstLeaf; lk < local.size(); lk++) {
+        vector3d min, max;
+        getCellBox(globalKey(lk), rootMin, rootMax, min, max);
+        float random = ((float) rand()) / (float) RAND_MAX;
+        vector3d pos = min + (max - min)*random;
+        DEBUG(CkPrintf("[%d] Particle created : (%6.2f, %6.2f, %6.2f)\n",
+            thisIndex, pos.x, pos.y, pos.z);)
+        local[lk] = BarnesNodeData(20.0, pos, min, max);
+      }
+      ParaTreeT::traceEnd("build", start);
+      refit();
+    }
+
+    /// First rank, in key order, of the snapshot particles in a piece's share
+    long long shareStart(int index) const {
+      long long nPieces = 1 << (3*pieceLevel);
+      return nodeCache->snapshot->count*index/nPieces;
+    }
+
+    /// Piece whose share holds this rank: the last one whose share starts at or before it
+    int shareHolding(long long rank) const {
+      long long nPieces = 1 << (3*pieceLevel);
+      return (int)(((rank + 1)*nPieces - 1)/nodeCache->snapshot->count);
+    }
+
+    /// Read a slice of the snapshot (the size of our share) and contribute its bounds,
+    /// as the root box the pieces sort by is only known once every slice is read.
+    /// Every piece reads its own slice, so the PEs read the file side by side.
+    void readParticles(ParaTreeT::SnapshotReader &snapshot) {
+      long long first = shareStart(thisIndex), n = shareStart(thisIndex + 1) - first;
+      sliceNodes.resize(n);
+      sliceVel.resize(n);
+      BarnesLeafSink sink(sliceNodes.data(), sliceVel.data(), first);
+      {
+        PARATREET_TRACE_PHASE("read particles");
+        snapshot.read(first, n, sink);
+      }
+      // The lower corner and the negated upper corner, so one minimum reduction finds both
+      double bounds[6] = {DBL_MAX, DBL_MAX, DBL_MAX, DBL_MAX, DBL_MAX, DBL_MAX};
+      if (n > 0) {
+        vector3d min, max;
+        leafBounds(sliceNodes.data(), n, min, max);
+        double mine[6] = {min.x, min.y, min.z, -max.x, -max.y, -max.z};
+        std::copy(mine, mine + 6, bounds);
+      }
+      contribute(sizeof(bounds), bounds, CkReduction::min_double,
+          CkCallback(CkIndex_Main::boundsFound(NULL), mainProxy));
+    }
+
+    /// Entry method called once the root box is set: sort our slice into key order in place,
+    /// and contribute evenly spaced keys of it, for Main to choose the splitters
+    void sortSlice() {
+      PARATREET_TRACE_PHASE("exchange particles");
+      int n = sliceNodes.size();
+      sortLeavesMorton(sliceNodes.data(), sliceVel.data(), n, rootMin, rootMax);
+      std::vector<unsigned long long> samples;
+      for (int s = 0; s < keySamples && s < n; s++)
+        samples.push_back(getMortonKey(sliceNodes[(long long)n*(2*s + 1)/(2*keySamples)].pos, rootMin, rootMax));
+      contribute(samples.size()*sizeof(unsigned long long), samples.data(), CkReduction::concat,
+          CkCallback(CkIndex_Main::samplesGathered(NULL), mainProxy));
+    }
+
+    /// First particle of our sorted slice whose key is at least this one
+    int sliceLowerBound(unsigned long long key) const {
+      int lo = 0, hi = sliceNodes.size();
+      while (lo < hi) {
+        int mid = (lo + hi)/2;
+        if (getMortonKey(sliceNodes[mid].pos, rootMin, rootMax) < key) lo = mid + 1;
+        else hi = mid;
+      }
+      return lo;
+    }
+
+    /// Entry method called with the first key of every piece after the first: send each run
+    /// of our slice between two splitters, without copying, to the piece starting at the
+    /// lower one.  The exchange detector counts runs produced here and consumed where they land.
+    void sendSlice(const std::vector<unsigned long long> &splitters) {
+      PARATREET_TRACE_PHASE("exchange particles");
+      int n = sliceNodes.size(), sent = 0;
+      for (int to = 0, begin = 0; to <= splitters.size() && begin < n; to++) {
+        int end = (to < splitters.size()) ? sliceLowerBound(splitters[to]) : n;
+        if (end > begin) {
+          thisProxy[to].receiveRun(end - begin, CkSendBuffer(&sliceNodes[begin]), CkSendBuffer(&sliceVel[begin]));
+          sent++;
         }
-        contribute(CkCallback(CkReductionTarget(Main, done), mainProxy));
+        begin = end;
       }
+      CompletionDetector *detector = exchangeDetector.ckLocalBranch();
+      detector->produce(sent);
+      detector->done();
+    }
+
+    /// Post entry method: a run of another piece's slice lands in a buffer of its own
+    void receiveRun(int &n, BarnesNodeData *&nodes, vector3d *&runVel, CkNcpyBufferPost *ncpyPost) {
+      runs.push_back(ExchangeRun());
+      runs.back().nodes.resize(n);
+      runs.back().vel.resize(n);
+      nodes = runs.back().nodes.data();
+      runVel = runs.back().vel.data();
+      ncpyPost[0].regMode = CK_BUFFER_REG;
+      ncpyPost[1].regMode = CK_BUFFER_REG;
     }
 
-    /// Begin computation
-    void startWork() {
+    /// Entry method called once a run of another piece's slice has landed
+    void receiveRun(int n, BarnesNodeData *nodes, vector3d *runVel) {
+      exchangeDetector.ckLocalBranch()->consume();
+    }
+
+    /// Entry method called once every run has landed: our slice is no longer needed.
+    /// Merge the runs we got into key order, and report how many particles they hold.
+    void mergeRuns() {
+      PARATREET_TRACE_PHASE("exchange particles");
+      std::vector<BarnesNodeData>().swap(sliceNodes);
+      std::vector<vector3d>().swap(sliceVel);
+      for (; !runs.empty(); runs.pop_front()) {
+        heldNodes.insert(heldNodes.end(), runs.front().nodes.begin(), runs.front().nodes.end());
+        heldVel.insert(heldVel.end(), runs.front().vel.begin(), runs.front().vel.end());
+      }
+      sortLeavesMorton(heldNodes.data(), heldVel.data(), heldNodes.size(), rootMin, rootMax);
+      HeldCount mine = {thisIndex, (long long)heldNodes.size()};
+      contribute(sizeof(mine), &mine, CkReduction::concat,
+          CkCallback(CkIndex_Main::heldGathered(NULL), mainProxy));
+    }
+
+    /// Entry method called with the rank, in key order, of the first particle we hold:
+    /// send each run of them, without copying, straight into the leaves of the piece
+    /// whose share holds it.  The buffers are freed in heldSent once every run is delivered.
+    void placeParticles(long long first) {
+      PARATREET_TRACE_PHASE("exchange particles");
+      CkCallback sent(CkIndex_BarnesTreePiece::heldSent(NULL), thisProxy[thisIndex]);
+      long long n = heldNodes.size();
+      for (long long rank = first; rank < first + n; ) {
+        int to = shareHolding(rank);
+        long long end = std::min(first + n, shareStart(to + 1));
+        int offset = rank - shareStart(to), count = end - rank;
+        BarnesNodeData *nodes = &heldNodes[rank - first];
+        vector3d *runVel = &heldVel[rank - first];
+        if (to == thisIndex) {
+          std::copy(nodes, nodes + count, &local[localFirstLeaf + offset]);
+          std::copy(runVel, runVel + count, &vel[offset]);
+          shareReceived += count;
+        }
+        else {
+          thisProxy[to].receiveShare(offset, count, CkSendBuffer(nodes, sent), CkSendBuffer(runVel, sent));
+          heldSending += 2;
+        }
+        rank = end;
+      }
+      freeHeld();
+      checkShare();
+    }
+
+    /// Zero-copy entry method callback: a buffer of a run sent by placeParticles was delivered
+    void heldSent(CkDataMsg *m) {
+      delete m;
+      heldSending--;
+      freeHeld();
+    }
+
+    /// Free the particles we held once nothing is being sent from them
+    void freeHeld() {
+      if (heldSending > 0) return;
+      std::vector<BarnesNodeData>().swap(heldNodes);
+      std::vector<vector3d>().swap(heldVel);
+    }
+
+    /// Post entry method: a run of our share lands straight in our leaves
+    void receiveShare(int &offset, int &n, BarnesNodeData *&nodes, vector3d *&runVel, CkNcpyBufferPost *ncpyPost) {
+      nodes = &local[localFirstLeaf + offset];
+      runVel = &vel[offset];
+      ncpyPost[0].regMode = CK_BUFFER_REG;
+      ncpyPost[1].regMode = CK_BUFFER_REG;
+    }
+
+    /// Entry method called once a run of our share has landed
+    void receiveShare(int offset, int n, BarnesNodeData *nodes, vector3d *runVel) {
+      shareReceived += n;
+      checkShare();
+    }
+
+    /// Once our whole share has landed, pad the leaves after it and build the tree above them
+    void checkShare() {
+      long long share = shareStart(thisIndex + 1) - shareStart(thisIndex);
+      if (shareReceived != share) return;
+      shareReceived = -1;
+      BarnesLeafSink sink(&local[localFirstLeaf], &vel[0], 0);
+      sink.filled = share;
+      vector3d min, max;
+      getCellBox(globalKey(1), rootMin, rootMax, min, max);
+      sink.pad(local.size() - localFirstLeaf, (min + max)/2);
+      refit();
+    }
+
+    /// Recompute the moments of the local subtree, then send them up to the owner of its parent
+    void refit() {
+      {
+        PARATREET_TRACE_PHASE("upward pass");
+        computeMoments(1);
+      }
+      BarnesKey root = globalKey(1);
+      if (root == 1) // a single piece holds the whole tree
+        mainProxy.treeBuilt();
+      else
+        sendMoments(local[1], root);
+    }
+
+    /// Recursively compute moments of the interior nodes of the local subtree
+    void computeMoments(BarnesKey lk) {
+      if (lk >= localFirstLeaf) return;
+      BarnesNodeData n = emptyMoments();
+      for (int i = 0; i < 8; i++) {
+        BarnesKey child = getChild(lk, i);
+        computeMoments(child);
+        addMoments(n, local[child]);
+      }
+      finishMoments(n);
+      local[lk] = n;
+    }
+
+    /// Opening kick and drift of the leapfrog step; the tree is then refit around the particles
+    void drift() {
+      double start = ParaTreeT::traceBegin();
+      for (int i = 0; i < consumers.size(); i++) {
+        BarnesNodeData &leaf = local[localFirstLeaf + i];
+        vel[i] = vel[i] + consumers[i].accel()*(timeStep/2);
+        vector3d d = vel[i]*timeStep;
+        leaf.pos = leaf.pos + d;
+        leaf.min = leaf.min + d;
+        leaf.max = leaf.max + d;
+      }
+      drifted = true;
+      ParaTreeT::traceEnd("drift", start);
+      refit();
+    }
+
+    /// Send the moments of a finished node to the piece owning its parent
+    void sendMoments(const BarnesNodeData &n, BarnesKey key) {
+      int owner = ownerOf(getParent(key));
+      if (owner == thisIndex)
+        receiveMoments(n, key);
+      else
+        thisProxy[owner].receiveMoments(n, key);
+    }
+
+    /// Entry method called with the moments of a child of one of our top-level nodes
+    void receiveMoments(const BarnesNodeData &n, const BarnesKey &key) {
+      PARATREET_TRACE_PHASE("upward pass");
+      BarnesKey parent = getParent(key);
+      if (topChildren[parent] == 0)
+        top[parent] = emptyMoments();
+      addMoments(top[parent], n);
+      if (++topChildren[parent] == 8) {
+        topChildren[parent] = 0; // ready for the next refit
+        finishMoments(top[parent]);
+        DEBUG(CkPrintf("[%d] top node %d finished\n", thisIndex, (int)parent);)
+        if (parent == 1) // the root finishes last
+          mainProxy.treeBuilt();
+        else
+          sendMoments(top[parent], parent);
+      }
+    }
+
+    /// Contribute the nodes we own on the replicated top levels
+    void shareTop() {
+      PARATREET_TRACE_PHASE("share top");
+      std::vector<TopEntry> mine;
+      for (std::map<BarnesKey, BarnesNodeData>::iterator it = top.begin(); it != top.end(); it++) {
+        if (getLevel(it->first) < replicatedLevels) {
+          TopEntry e = {it->first, it->second};
+          mine.push_back(e);
+        }
+      }
+      BarnesKey localEnd = (replicatedLevels > pieceLevel) ? getLevelStart(replicatedLevels - pieceLevel) : 1;
+      for (BarnesKey lk = 1; lk < localEnd; lk++) {
+        TopEntry e = {globalKey(lk), local[lk]};
+        mine.push_back(e);
+      }
+      contribute(mine.size()*sizeof(TopEntry), mine.data(), CkReduction::concat,
+          CkCallback(CkIndex_Main::topGathered(NULL), mainProxy));
+    }
+
+    /// Once every consumer of this walk has started, tell its detector we start no more.
+    /// Requests still in flight may produce more; the detector finishes once all are consumed.
+    void checkDone(int walk) {
+      WalkProgress &w = walks[walk];
+      if (w.running && w.next == walkSize(walk)) {
+        DEBUG(CkPrintf("[%d] walk %d started\n", thisIndex, walk);)
+        w.running = false;
+        detectors[walk].ckLocalBranch()->done();
+      }
+    }
+
+    /// Entry method called once every walk of the iteration is complete everywhere
+    void finishStep() {
+      PARATREET_TRACE_PHASE("finish step");
+      interactions = 0;
+      for (int i = 0; i < consumers.size(); i++) {
+        MYDEBUG(CkPrintf("[%d] Acceleration of particle %d : (%f, %f, %f)\n", thisIndex, i,
+            consumers[i].ax, consumers[i].ay, consumers[i].az);)
+        interactions += consumers[i].interactions;
+        if (drifted) // closing kick of the leapfrog step
+          vel[i] = vel[i] + consumers[i].accel()*(timeStep/2);
+      }
+      drifted = false;
+      // Sum the distances to the farthest nearest neighbour, over the particles that looked for them
+      double neighbors[2] = {0.0, 0.0};
+      for (int i = 0; i < neighborConsumers.size(); i++) {
+        if (local[localFirstLeaf + i].mass <= 0.0f) continue;
+        neighbors[0] += neighborConsumers[i].radius();
+        neighbors[1] += 1.0;
+      }
+      // Report the sum and max of the piece costs, and the busiest PE, so Main can see the imbalance
+      double cost[2] = {walkTime, (double)interactions};
+      double peLoad = peWalkTime(); // every walk is over, so this PE's total is complete
+      peWalkTime() = 0.0;
+      PARATREET_STAT(ParaTreeT::StatsContribution stats;) // traversal counters of this PE, if we are its first piece
+      CkReduction::tupleElement tupleRedn[] = {
+        CkReduction::tupleElement(sizeof(double), &cost[0], CkReduction::sum_double),
+        CkReduction::tupleElement(sizeof(double), &cost[0], CkReduction::max_double),
+        CkReduction::tupleElement(sizeof(double), &cost[1], CkReduction::sum_double),
+        CkReduction::tupleElement(sizeof(double), &cost[1], CkReduction::max_double),
+        CkReduction::tupleElement(sizeof(double), &peLoad, CkReduction::max_double),
+        CkReduction::tupleElement(sizeof(neighbors), neighbors, CkReduction::sum_double),
+#ifdef PARATREET_STATS
+        stats.sumElement(),
+        stats.maxElement()
+#endif
+      };
+      CkReductionMsg *msg = CkReductionMsg::buildFromTuple(tupleRedn, sizeof(tupleRedn)/sizeof(tupleRedn[0]));
+      msg->setCallback(CkCallback(CkIndex_Main::done(NULL), mainProxy));
+      contribute(msg);
+      // Start counting the next step here, not in startWork: requests other pieces send us
+      // before our own startWork arrives are part of its cost
+      walkTime = 0.0;
+    }
+
+    /// Entry method contributing the phases traced on this PE, if we are its first piece
+    void shareTrace() {
+      std::vector<ParaTreeT::TraceEvent> mine = ParaTreeT::takeThreadTraceEvents();
+      contribute(mine.size()*sizeof(ParaTreeT::TraceEvent), mine.data(), CkReduction::concat,
+          CkCallback(CkIndex_Main::traceGathered(NULL), mainProxy));
+    }
+
+    /// Create one consumer for each local leaf, for each walk type
+    void makeConsumers() {
+      consumers.clear();
+      consumers.reserve(local.size() - localFirstLeaf);
+      for (BarnesKey lk = localFirstLeaf; lk < local.size(); lk++)
+        consumers.push_back(LeafConsumer(*this, local[lk]));
+      neighborConsumers.clear();
+      if (neighborCount > 0) {
+        neighborConsumers.reserve(local.size() - localFirstLeaf);
+        for (BarnesKey lk = localFirstLeaf; lk < local.size(); lk++)
+          neighborConsumers.push_back(NeighborConsumer(*this, local[lk], neighborCount));
+      }
+    }
+
+    /// Begin computation: start every walk type, each reporting to its completion detector
+    void startWork(const std::vector<CProxy_CompletionDetector> &walkDetectors) {
       DEBUG(CkPrintf("[%d]startWork()\n", thisIndex);)
-      remoteCounter = 0;
-      if (thisIndex >= firstLeaf)
-        requestKey(1, *cons);
-      checkDone();
+      double start = CkWallTimer();
+      detectors = walkDetectors;
+      prefetchPending = 0;
+      if (prefetch) {
+        PARATREET_TRACE_PHASE("prefetch");
+        // One bulk request to each owner of nodes we will likely need
+        collectPrefetch(1, prefetchKeys);
+        for (std::map<int, std::vector<BarnesKey> >::iterator it = prefetchKeys.begin(); it != prefetchKeys.end(); it++) {
+          std::sort(it->second.begin(), it->second.end());
+          prefetchNodes[it->first].resize(it->second.size());
+          CkEntryOptions opts = prioritized(remotePriority);
+          thisProxy[it->first].requestPrefetch(encodeKeys(it->second), thisIndex, &opts);
+          prefetchPending++;
+          PARATREET_COUNT(STAT_REMOTE_REQUESTS, 1);
+        }
+      }
+      addWalkTime(CkWallTimer() - start);
+      if (prefetchPending == 0)
+        walk();
+    }
+
+    /// Start every walk type over the tree, side by side
+    void walk() {
+      makeConsumers();
+      for (int w = 0; w < NUM_WALK_TYPES; w++) {
+        walks[w].next = 0;
+        walks[w].running = true;
+        resumeWalk(w);
+      }
+    }
+
+    /// Number of consumers walking in this walk
+    int walkSize(int walk) {
+      switch (walk) {
+        case GRAVITY_WALK: return consumers.size();
+        case KNN_WALK: return neighborConsumers.size();
+      }
+      return 0;
+    }
+
+    /// Walk type of a consumer
+    int walkOf(const LeafConsumer &c) {
+      return GRAVITY_WALK;
+    }
+    int walkOf(const NeighborConsumer &c) {
+      return KNN_WALK;
+    }
+
+    /// Entry method walking the next chunk of consumers, then yielding so replies can get in
+    void resumeWalk(int walk) {
+      double start = CkWallTimer();
+      double traceStart = ParaTreeT::traceBegin();
+      WalkProgress &w = walks[walk];
+      int end = std::min(walkSize(walk), w.next + walkChunk);
+      for (; w.next < end; w.next++) {
+        switch (walk) {
+          case GRAVITY_WALK: requestKey(1, consumers[w.next]); break;
+          case KNN_WALK: // padding leaves have no neighbours to look for
+            if (local[localFirstLeaf + w.next].mass > 0.0f) requestKey(1, neighborConsumers[w.next]);
+            break;
+        }
+      }
+      ParaTreeT::traceEnd("walk", traceStart);
+      addWalkTime(CkWallTimer() - start);
+      if (w.next < walkSize(walk)) {
+        CkEntryOptions opts = prioritized(walkPriority);
+        thisProxy[thisIndex].resumeWalk(walk, &opts);
+      }
+      else
+        checkDone(walk);
+    }
+
+    /**
+     * Collect the remote keys our walk will likely need, by opening cells on
+     * geometry alone.  A cell is opened when its diagonal is large compared to
+     * its closest distance to our bounding box, which is at least as eager as
+     * BarnesConsumer's test for any of our particles.  Keys claimed by another
+     * piece of this process are already on their way and are skipped.
+     *
+     * Cells are measured by their refit bounds where this process has them:
+     * the replicated levels and the top nodes of its own pieces.  Deeper remote
+     * cells are measured by their static cell box, which the particles leave
+     * as they drift, so after the first step the prefetch covers less than
+     * the walk needs there; the walk fetches the rest as usual.
+     */
+    void collectPrefetch(BarnesKey bk, std::map<int, std::vector<BarnesKey> > &wanted) {
+      int owner = ownerOf(bk);
+      BarnesTreePiece *ownerPiece = (owner == thisIndex) ? this : nodeCache->localPiece(owner);
+      bool inProcess = (ownerPiece != NULL);
+      if (inProcess && getLevel(bk) >= pieceLevel)
+        return; // the whole subtree is in this process
+      if (!inProcess && !nodeCache->has(bk) && nodeCache->remote.claim(bk))
+        wanted[owner].push_back(bk);
+      if (isLeafKey(bk))
+        return;
+
+      vector3d min, max;
+      const BarnesNodeData *known = nodeCache->has(bk) ? &nodeCache->nodes[bk]
+          : (inProcess ? ownerPiece->lookupNode(bk) : NULL);
+      if (known && known->mass > 0.0f) {
+        min = known->min;
+        max = known->max;
+      }
+      else
+        getCellBox(bk, rootMin, rootMax, min, max);
+      const BarnesNodeData &box = local[1];
+      vector3d gap(fmaxf(0.0f, fmaxf(min.x - box.max.x, box.min.x - max.x)),
+                   fmaxf(0.0f, fmaxf(min.y - box.max.y, box.min.y - max.y)),
+                   fmaxf(0.0f, fmaxf(min.z - box.max.z, box.min.z - max.z)));
+      vector3d diagonal = max - min;
+      float distance = sqrt(gap.x*gap.x + gap.y*gap.y + gap.z*gap.z);
+      float size = sqrt(diagonal.x*diagonal.x + diagonal.y*diagonal.y + diagonal.z*diagonal.z);
+      if (size > prefetchThreshold*distance)
+        for (int i = 0; i < 8; i++)
+          collectPrefetch(getChild(bk, i), wanted);
+    }
+
+    /**
+     * Entry method called to request a batch of our nodes for a prefetching piece,
+     * as ascending delta-encoded keys.  The packed nodes are gathered once into a
+     * reply buffer that is sent without copying, and freed in prefetchSent once
+     * the requester has received it.
+     */
+    void requestPrefetch(const std::vector<unsigned char> &encodedKeys, int pieceIndex) {
+      PARATREET_TRACE_PHASE("serve prefetch");
+      double start = CkWallTimer();
+      std::vector<BarnesKey> keys = decodeKeys(encodedKeys);
+      int n = keys.size();
+      BarnesPackedNode *reply = new BarnesPackedNode[n];
+      for (int i = 0; i < n; i++)
+        reply[i] = BarnesPackedNode(*lookupNode(keys[i]), keys[i], rootMin, rootMax);
+      CkCallback sent(CkIndex_BarnesTreePiece::prefetchSent(NULL), thisProxy[thisIndex]);
+      CkEntryOptions opts = prioritized(remotePriority);
+      thisProxy[pieceIndex].receivePrefetch(thisIndex, n, CkSendBuffer(reply, sent), &opts);
+      addWalkTime(CkWallTimer() - start);
+    }
+
+    /// Entry method called once a prefetch reply buffer has been transferred
+    void prefetchSent(CkDataMsg *m) {
+      CkNcpyBuffer *src = (CkNcpyBuffer *)(m->data);
+      delete [] (BarnesPackedNode *)src->ptr;
+      delete m;
+    }
+
+    /// Post entry method: a prefetch reply lands in the buffer we set aside for its owner
+    void receivePrefetch(int &owner, int &n, BarnesPackedNode *&nodes, CkNcpyBufferPost *ncpyPost) {
+      nodes = prefetchNodes[owner].data();
+      ncpyPost[0].regMode = CK_BUFFER_REG;
+    }
+
+    /// Entry method called with a batch of prefetched nodes, cached for every PE of this process
+    void receivePrefetch(int owner, int n, BarnesPackedNode *nodes) {
+      double start = ParaTreeT::traceBegin();
+      const std::vector<BarnesKey> &keys = prefetchKeys[owner];
+      PARATREET_COUNT(STAT_BYTES_RECEIVED, n*sizeof(BarnesPackedNode));
+      for (int i = 0; i < n; i++)
+        nodeCache->remote.insert(keys[i], nodes[i].unpack(keys[i], rootMin, rootMax));
+      ParaTreeT::traceEnd("receive prefetch", start);
+      if (--prefetchPending == 0) {
+        prefetchKeys.clear();
+        prefetchNodes.clear();
+        walk();
+      }
+    }
+
+    /// Let the load balancer migrate us between iterations
+    void balance() {
+      AtSync();
     }
 
-    BarnesTreePiece(CkMigrateMessage *m) {}
+    /// Called by the load balancer when migrations are over
+    void ResumeFromSync() {
+      contribute(CkCallback(CkReductionTarget(Main, balanced), mainProxy));
+    }
+
+    /// Index of this consumer in our consumer array
+    int consumerIndex(const LeafConsumer &c) {
+      return (int)(&c - &consumers[0]);
+    }
+    int consumerIndex(const NeighborConsumer &c) {
+      return (int)(&c - &neighborConsumers[0]);
+    }
 
     /// Method called to request a node
     template <class Consumer>
     void requestKey(const BarnesKey &bk, Consumer &c) {
-      if (bk < 1 || bk >= treeSize)
+      PARATREET_STACK_DEPTH;
+      PARATREET_COUNT(STAT_WALKS, bk == 1);
+      if (bk < 1 || bk >= getLevelStart(treeDepth)) {
         CkPrintf("BarnesParaTree: Requested INVALID tree node %d\n", (int)bk);
-      else if (bk == thisIndex) {   //Local node
-        if (bk >= firstLeaf)
-          c.consumeLeaf(node, bk);  //Call consumer's leaf method
+        return;
+      }
+      int owner = ownerOf(bk);
+      const BarnesNodeData *n = NULL;
+      if (nodeCache->has(bk)) //Replicated top node
+        n = &nodeCache->nodes[bk];
+      else if (owner == thisIndex) //Local node
+        n = lookupNode(bk);
+      else if (BarnesTreePiece *p = nodeCache->localPiece(owner)) //Node of a piece in this process
+        n = p->lookupNode(bk);
+      else { //Remote node fetched earlier by some PE of this process
+        n = nodeCache->remote.lookup(bk);
+        PARATREET_COUNT(STAT_CACHE_HITS, n != NULL);
+        PARATREET_COUNT(STAT_CACHE_MISSES, n == NULL);
+      }
+
+      if (n) {
+        if (isLeafKey(bk))
+          c.consumeLeaf(*n, bk);  //Call consumer's leaf method
         else
-          c.consumeNode(node, bk);  //Call consumer's node method
+          c.consumeNode(*n, bk);  //Call consumer's node method
       }
       else { //Remote node
-        remoteCounter++;
+        RemoteRequest r = {bk, walkOf(c), consumerIndex(c)};
+        detectors[r.walk].ckLocalBranch()->produce();
+        PARATREET_COUNT(STAT_REMOTE_REQUESTS, 1);
         //Send a remote node request
-        thisProxy[bk].requestRemoteNode(bk, thisIndex);
+        CkEntryOptions opts = prioritized(remotePriority);
+        thisProxy[owner].requestRemoteNode(bk, thisIndex, newTicket(r), &opts);
       }
     }
 
@@ -87,26 +956,73 @@ class BarnesTreePiece : public CBase_BarnesTreePiece {
       }
     }
 
+    /// Remember a remote request until its reply comes back, returning its ticket
+    int newTicket(const RemoteRequest &r) {
+      if (freeTickets.empty()) {
+        requests.push_back(r);
+        return requests.size() - 1;
+      }
+      int ticket = freeTickets.back();
+      freeTickets.pop_back();
+      requests[ticket] = r;
+      return ticket;
+    }
+
+    /// The request a reply answers; its ticket can then be reused
+    RemoteRequest takeTicket(int ticket) {
+      freeTickets.push_back(ticket);
+      return requests[ticket];
+    }
+
     /// Entry method called to request for a remote node
-    void requestRemoteNode(BarnesKey bk, int consIndex) {
-      if (bk >= firstLeaf)
-        thisProxy[consIndex].consumeRemoteLeaf(node, bk);
+    void requestRemoteNode(BarnesKey bk, int pieceIndex, int ticket) {
+      PARATREET_TRACE_PHASE("serve remote");
+      double start = CkWallTimer();
+      const BarnesNodeData *n = lookupNode(bk);
+      CkEntryOptions opts = prioritized(remotePriority);
+      if (isLeafKey(bk))
+        thisProxy[pieceIndex].consumeRemoteLeaf(BarnesPackedLeaf(*n, bk, rootMin, rootMax), ticket, &opts);
       else
-        thisProxy[consIndex].consumeRemoteNode(node, bk);
+        thisProxy[pieceIndex].consumeRemoteNode(BarnesPackedNode(*n, bk, rootMin, rootMax), ticket, &opts);
+      addWalkTime(CkWallTimer() - start);
     }
 
     /// Entry method called to respond to a remote node request which is an internal node
-    void consumeRemoteNode(const BarnesNodeData &n, const BarnesKey &key) {
-      remoteCounter--;
-      cons->consumeNode(n, key); //Call consumer's node method now that remote node is available
-      checkDone();
+    void consumeRemoteNode(const BarnesPackedNode &packed, int ticket) {
+      double start = CkWallTimer();
+      double traceStart = ParaTreeT::traceBegin();
+      RemoteRequest r = takeTicket(ticket);
+      const BarnesKey &key = r.key;
+      int walk = r.walk, consIndex = r.consIndex;
+      PARATREET_COUNT(STAT_BYTES_RECEIVED, sizeof(packed));
+      BarnesNodeData n = packed.unpack(key, rootMin, rootMax);
+      nodeCache->remote.insert(key, n);
+      switch (walk) { //Call consumer's node method now that remote node is available
+        case GRAVITY_WALK: consumers[consIndex].consumeNode(n, key); break;
+        case KNN_WALK: neighborConsumers[consIndex].consumeNode(n, key); break;
+      }
+      ParaTreeT::traceEnd("remote walk", traceStart);
+      addWalkTime(CkWallTimer() - start);
+      detectors[walk].ckLocalBranch()->consume(); // after any requests this reply led to
     }
 
     /// Entry method called to respond to a remote node request which is a leaf node
-    void consumeRemoteLeaf(const BarnesLeafData &n, const BarnesKey &key) {
-      remoteCounter--;
-      cons->consumeLeaf(n, key); //Call consumer's leaf method now that remote leaf is available
-      checkDone();
+    void consumeRemoteLeaf(const BarnesPackedLeaf &packed, int ticket) {
+      double start = CkWallTimer();
+      double traceStart = ParaTreeT::traceBegin();
+      RemoteRequest r = takeTicket(ticket);
+      const BarnesKey &key = r.key;
+      int walk = r.walk, consIndex = r.consIndex;
+      PARATREET_COUNT(STAT_BYTES_RECEIVED, sizeof(packed));
+      BarnesLeafData n = packed.unpack(key, rootMin, rootMax);
+      nodeCache->remote.insert(key, BarnesNodeData(n.mass, n.pos, n.pos, n.pos));
+      switch (walk) { //Call consumer's leaf method now that remote leaf is available
+        case GRAVITY_WALK: consumers[consIndex].consumeLeaf(n, key); break;
+        case KNN_WALK: neighborConsumers[consIndex].consumeLeaf(n, key); break;
+      }
+      ParaTreeT::traceEnd("remote walk", traceStart);
+      addWalkTime(CkWallTimer() - start);
+      detectors[walk].ckLocalBranch()->consume(); // after any requests this reply led to
     }
 };
 
@@ -115,83 +1031,257 @@ class BarnesTreePiece : public CBase_BarnesTreePiece {
  */
 class Main : public CBase_Main {
   public:
-    BarnesNodeData *tree;
-    BarnesKey treeSize; // total number of nodes
-    BarnesKey treeRoot, firstLeaf;
     double startTime;
+    int nPieces;
+    int step, nSteps; // leapfrog steps; each one ends with a walk
+    double stepStart;
+    double lbThreshold; // load balance when the busiest PE exceeds the average by this factor
+    std::vector<BarnesNodeData> top; // replicated levels, sent from here without copying
+    std::vector<CProxy_CompletionDetector> detectors; // one per walk type
+    std::vector<unsigned long long> splitters; // first key of each piece after the first, in the snapshot exchange
+    int walksStarting, walksRunning;
+    std::string traceFile; // where the timeline goes, if tracing
+    double stepTrace; // start of the step in the timeline
 
   Main(CkArgMsg *m) {
-    int depth = 3; // depth of tree
-    if (m->argc == 2) {
-      depth = atoi(m->argv[1]);
+    treeDepth = 3; // depth of tree
+    pieceLevel = 1; // tree pieces start on this level
+    if (m->argc >= 2) {
+      treeDepth = atoi(m->argv[1]);
     }
+    // Particles come from this snapshot if given; the tree is then just deep enough to hold them
+    std::string snapshotFile;
+    if (m->argc >= 9 && strcmp(m->argv[8], "-") != 0) {
+      snapshotFile = m->argv[8];
+      ParaTreeT::SnapshotReader snapshot(m->argv[8]);
+      if (!snapshot.ok()) {
+        CkPrintf("[Main] Could not read snapshot %s\n", m->argv[8]);
+        CkExit();
+        return;
+      }
+      treeDepth = getDepthFor(snapshot.count);
+      CkPrintf("[Main] Reading %lld particles from %s\n", snapshot.count, m->argv[8]);
+    }
+    if (m->argc >= 3) {
+      pieceLevel = atoi(m->argv[2]);
+    }
+    if (pieceLevel > treeDepth - 1) pieceLevel = treeDepth - 1;
+    if (pieceLevel < 0) pieceLevel = 0;
+    replicatedLevels = pieceLevel; // by default, everything above the pieces
+    if (m->argc >= 4) {
+      replicatedLevels = atoi(m->argv[3]);
+    }
+    if (replicatedLevels > treeDepth) replicatedLevels = treeDepth;
+    if (replicatedLevels < 0) replicatedLevels = 0;
+    nSteps = 0;
+    if (m->argc >= 5) {
+      nSteps = atoi(m->argv[4]);
+    }
+    timeStep = 0.1;
+    if (m->argc >= 6) {
+      timeStep = atof(m->argv[5]);
+    }
+    cacheSize = 1 << 16;
+    if (m->argc >= 7) {
+      cacheSize = atoi(m->argv[6]);
+    }
+    prefetch = false;
+    if (m->argc >= 8) {
+      prefetch = atoi(m->argv[7]);
+    }
+    // Each particle also finds this many nearest neighbours (at most 64)
+    neighborCount = 0;
+    if (m->argc >= 10) {
+      neighborCount = atoi(m->argv[9]);
+    }
+    step = 0;
+    lbThreshold = 1.1;
+    delete m;
+    // Record phases for a timeline if PARATREET_TRACE names a file
+    const char *traceEnv = ParaTreeT::traceFileFromEnv();
+    tracing = (traceEnv != NULL);
+    if (tracing) traceFile = traceEnv;
+    ParaTreeT::traceEnable(tracing);
 
-    treeSize = (BarnesKey)((int)pow(8, depth)/7 + 1);
-    treeRoot = 1;
-    firstLeaf = (int)pow(8, depth)/56 + 1;
-
-    tree = new BarnesNodeData[treeSize];
-    vector3d min = {0.0, 0.0, 0.0};
-    vector3d max = {100.0, 100.0, 100.0};
-    constructNode(treeRoot, min, max);
-
+    nPieces = 1 << (3*pieceLevel);
     mainProxy = thisProxy;
-    tpProxy = CProxy_BarnesTreePiece::ckNew();
-
-    // Dynamic insertion of treepieces
-    for (int i = 1; i < treeSize; i++) {
-      tpProxy[i].insert(tree[i], firstLeaf, treeSize);
-    }
-    // Finish insertion
-    tpProxy.doneInserting();
-    CkPrintf("[Main] Create tree-piece array\n");
+    cacheProxy = CProxy_BarnesNodeCache::ckNew(snapshotFile);
+    tpProxy = CProxy_BarnesTreePiece::ckNew(nPieces);
+    for (int w = 0; w < NUM_WALK_TYPES; w++)
+      detectors.push_back(CProxy_CompletionDetector::ckNew());
+    exchangeDetector = CProxy_CompletionDetector::ckNew();
+    CkPrintf("[Main] Created %d tree pieces on level %d of a %d-level tree\n",
+        nPieces, pieceLevel, treeDepth);
 
-    startTime = CkWallTimer();
-    tpProxy.startWork();
+    // Each piece builds its own subtree; the top levels are summed up from there
+    startTime = stepStart = CkWallTimer();
+    stepTrace = ParaTreeT::traceBegin();
+    tpProxy.build();
   }
 
   Main(CkMigrateMessage *m){}
 
-  /// Method called on reduction to indicate end of compuatations
-  void done() {
-    CkPrintf("[Main] Elapsed time: %lf\n", CkWallTimer() - startTime);
-    CkPrintf("[Main] Done with 3D Barnes-Hut computations\n");
-    CkExit();
+  /// Method called with the bounds of every snapshot slice: make them the root box of every process
+  void boundsFound(CkReductionMsg *m) {
+    double *b = (double *)m->getData();
+    vector3d min(b[0], b[1], b[2]), max(-b[3], -b[4], -b[5]);
+    delete m;
+    CkPrintf("[Main] Particles within (%g, %g, %g) and (%g, %g, %g)\n", min.x, min.y, min.z, max.x, max.y, max.z);
+    cacheProxy.setRoot(min, max);
   }
 
-  bool isLeaf(int index) {
-    return (index >= firstLeaf);
+  /// Method called once every process has the root box: the pieces sort their slices by it
+  void rootSet() {
+    tpProxy.sortSlice();
   }
-  
 
-  /// Construct the tree in an array form recursively
-  void constructNode(int index, vector3d min, vector3d max) {
-    // Interior node
-    if (!isLeaf(index)) {
-      vector3d mid = (min+max)/2;
-      tree[index] = BarnesNodeData(20.0, mid, min, max);
+  /// Method called with the key samples of every slice: split them evenly among the pieces,
+  /// then arm the exchange detector before the pieces send their slices
+  void samplesGathered(CkReductionMsg *m) {
+    int n = m->getSize()/sizeof(unsigned long long);
+    unsigned long long *samples = (unsigned long long *)m->getData();
+    std::sort(samples, samples + n);
+    splitters.assign(nPieces - 1, 0);
+    for (int p = 1; p < nPieces && n > 0; p++)
+      splitters[p - 1] = samples[(long long)n*p/nPieces];
+    delete m;
+    exchangeDetector.start_detection(nPieces, CkCallback(CkIndex_Main::exchangeReady(), thisProxy),
+        CkCallback(CkCallback::ignore), CkCallback(CkIndex_Main::runsExchanged(), thisProxy), 0);
+  }
 
-      constructNode(getChild(index, 0), vector3d(min.x,min.y,min.z), vector3d(mid.x,mid.y,mid.z));
-      constructNode(getChild(index, 1), vector3d(mid.x,min.y,min.z), vector3d(max.x,mid.y,mid.z));
-      constructNode(getChild(index, 2), vector3d(min.x,mid.y,min.z), vector3d(mid.x,max.y,mid.z));
-      constructNode(getChild(index, 3), vector3d(mid.x,mid.y,min.z), vector3d(max.x,max.y,mid.z));
+  /// Method called once the exchange detector is armed
+  void exchangeReady() {
+    tpProxy.sendSlice(splitters);
+  }
 
-      constructNode(getChild(index, 4), vector3d(min.x,min.y,mid.z), vector3d(mid.x,mid.y,max.z));
-      constructNode(getChild(index, 5), vector3d(mid.x,min.y,mid.z), vector3d(max.x,mid.y,max.z));
-      constructNode(getChild(index, 6), vector3d(min.x,mid.y,mid.z), vector3d(mid.x,max.y,max.z));
-      constructNode(getChild(index, 7), vector3d(mid.x,mid.y,mid.z), vector3d(max.x,max.y,max.z));
+  /// Method called once every run of the slices has landed
+  void runsExchanged() {
+    tpProxy.mergeRuns();
+  }
 
+  /// Method called with the particles each piece holds, in key order across the pieces:
+  /// tell each piece the rank of its first one, so it can send them on to their shares
+  void heldGathered(CkReductionMsg *m) {
+    int n = m->getSize()/sizeof(HeldCount);
+    HeldCount *held = (HeldCount *)m->getData();
+    std::vector<long long> first(nPieces + 1, 0);
+    for (int i = 0; i < n; i++)
+      first[held[i].piece + 1] = held[i].count;
+    delete m;
+    for (int p = 0; p < nPieces; p++) {
+      first[p + 1] += first[p];
+      tpProxy[p].placeParticles(first[p]);
     }
-    // Leaf node
+  }
+
+  /// Method called by the owner of the root once its moments are complete
+  void treeBuilt() {
+    DEBUG(CkPrintf("[Main] Tree build time: %lf\n", CkWallTimer() - startTime);)
+    if (replicatedLevels > 0)
+      tpProxy.shareTop();
     else {
-      float random = ((float) rand()) / (float) RAND_MAX;
-      vector3d pos = min + (max - min)*random;
-      DEBUG(printf("[%d] Particle created : (%6.2f, %6.2f, %6.2f)\n",
-          index, pos.x, pos.y, pos.z);)
+      top.assign(1, emptyMoments()); // key 0 is never used
+      broadcastTop();
+    }
+  }
 
-      tree[index] = BarnesNodeData(20.0, pos, min, max);
+  /// Method called with all nodes on the replicated levels: broadcast them to every PE
+  void topGathered(CkReductionMsg *m) {
+    top.resize(getLevelStart(replicatedLevels));
+    int n = m->getSize()/sizeof(TopEntry);
+    TopEntry *entries = (TopEntry *)m->getData();
+    for (int i = 0; i < n; i++)
+      top[entries[i].key] = entries[i].node;
+    delete m;
+    broadcastTop();
+  }
+
+  /// Send the replicated levels to every process.  top stays untouched until the next build,
+  /// long after every process has received it, so the broadcast needs no completion callback.
+  void broadcastTop() {
+    cacheProxy.receiveTop(top.size(), CkSendBuffer(top.data()));
+  }
+
+  /// Method called once every PE holds the replicated levels: arm a detector for each walk.
+  /// Each piece is a producer: done() once its consumers have all started, and
+  /// produce()/consume() around each remote request.  A walk is complete when the
+  /// detector finishes, so all_produced is ignored.
+  void topReplicated() {
+    startTime = CkWallTimer();
+    walksStarting = NUM_WALK_TYPES;
+    for (int w = 0; w < NUM_WALK_TYPES; w++)
+      detectors[w].start_detection(nPieces, CkCallback(CkIndex_Main::walkReady(), thisProxy),
+          CkCallback(CkCallback::ignore), CkCallback(CkIndex_Main::walkDone(), thisProxy), 0);
+  }
+
+  /// Method called as each walk's detector is ready: start the walks once all are
+  void walkReady() {
+    if (--walksStarting == 0) {
+      walksRunning = NUM_WALK_TYPES;
+      tpProxy.startWork(detectors);
     }
   }
+
+  /// Method called as each walk completes on every piece: finish the step once all have
+  void walkDone() {
+    if (--walksRunning == 0)
+      tpProxy.finishStep();
+  }
+
+  /// Method called on reduction to indicate end of compuatations, with the piece costs
+  void done(CkReductionMsg *m) {
+    CkPrintf("[Main] Elapsed time: %lf\n", CkWallTimer() - startTime);
+
+    int numReductions;
+    CkReduction::tupleElement *results;
+    m->toTuple(&results, &numReductions);
+    double sumTime = *(double *)results[0].data, maxTime = *(double *)results[1].data;
+    double sumInteractions = *(double *)results[2].data, maxInteractions = *(double *)results[3].data;
+    double maxPeLoad = *(double *)results[4].data;
+    double neighborRadii = ((double *)results[5].data)[0], neighborQueries = ((double *)results[5].data)[1];
+    PARATREET_STAT(ParaTreeT::TraversalStats stats = ParaTreeT::StatsContribution::reduced(results[6], results[7]);)
+    double imbalance = (sumTime > 0.0) ? maxPeLoad*CkNumPes()/sumTime : 1.0;
+    delete [] results;
+    delete m;
+    CkPrintf("[Main] Step %d: %lf s, %.0f interactions, piece time max/avg %.2f, interactions max/avg %.2f, PE imbalance %.2f\n",
+        step, CkWallTimer() - stepStart, sumInteractions, maxTime*nPieces/sumTime,
+        maxInteractions*nPieces/sumInteractions, imbalance);
+    if (neighborQueries > 0.0)
+      CkPrintf("[Main] %d nearest neighbours of %.0f particles: mean distance to the farthest %f\n",
+          neighborCount, neighborQueries, neighborRadii/neighborQueries);
+    PARATREET_STAT(stats.print("[Main] Traversal statistics");)
+    ParaTreeT::traceEnd("step", stepTrace);
+
+    if (step++ < nSteps) {
+      stepStart = CkWallTimer();
+      stepTrace = ParaTreeT::traceBegin();
+      // Only pay for load balancing when the walk was measurably imbalanced
+      if (imbalance > lbThreshold)
+        tpProxy.balance();
+      else
+        tpProxy.drift();
+    } else {
+      CkPrintf("[Main] Done with 3D Barnes-Hut computations\n");
+      if (tracing)
+        tpProxy.shareTrace();
+      else
+        CkExit();
+    }
+  }
+
+  /// Method called with the phases traced on every PE: write the timeline, then exit
+  void traceGathered(CkReductionMsg *m) {
+    int n = m->getSize()/sizeof(ParaTreeT::TraceEvent);
+    if (ParaTreeT::writeTrace(traceFile.c_str(), (ParaTreeT::TraceEvent *)m->getData(), n))
+      CkPrintf("[Main] Wrote %d traced phases to %s\n", n, traceFile.c_str());
+    delete m;
+    CkExit();
+  }
+
+  /// Method called once the pieces have been load balanced: continue the step
+  void balanced() {
+    tpProxy.drift();
+  }
 };
 
 #include "barnes.def.h"
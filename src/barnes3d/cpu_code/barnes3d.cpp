@@ -1,39 +1,114 @@
 #include "barnes3d_cputree.h"
+#include "barnes3d_pagedtree.h"
+#include "ball3d.h"
+#include "knn3d.h"
+#include "paratreet_output.h"
+#include "paratreet_trace.h"
 #include <chrono>
+#include <cstring>
+#include <vector>
 
 int main(int argc, char *argv[]){
 
-	//depth of the binary tree
+	//depth of the binary tree if a number, else a snapshot file to load (the depth then fits its particles)
 	int depth = 3;
-  if (argc == 2) {
-    depth = atoi(argv[1]);
+	ParaTreeT::SnapshotReader *snapshot = NULL;
+  if (argc >= 2) {
+    if (argv[1][0] && strspn(argv[1], "0123456789") == strlen(argv[1]))
+      depth = atoi(argv[1]);
+    else {
+      snapshot = new ParaTreeT::SnapshotReader(argv[1]);
+      if (!snapshot->ok()) return 1;
+      depth = getDepthFor(snapshot->count);
+    }
+  }
+  // Also walk a compressed copy of the tree, and compare memory, time and accuracy
+  bool compare = false;
+  if (argc >= 3) {
+    compare = atoi(argv[2]);
+  }
+  // Tree file to map instead of building the tree, or to save the built tree in
+  const char *treeFile = NULL;
+  if (argc >= 4) {
+    treeFile = argv[3];
+  }
+  // Memory budget (KB) for also walking the tree file out of core
+  long pagedBudget = 0;
+  if (argc >= 5) {
+    pagedBudget = atol(argv[4]);
+  }
+  // File to write the leaf accelerations and potentials to ("-" for none)
+  const char *resultFile = NULL;
+  if (argc >= 6 && strcmp(argv[5], "-") != 0) {
+    resultFile = argv[5];
+  }
+  // Also find this many nearest neighbours of every particle (at most 64)
+  int neighbors = 0;
+  if (argc >= 7) {
+    neighbors = atoi(argv[6]);
+  }
+  // Also find every particle within this distance of each particle, listing and counting them
+  float searchRadius = 0.0f;
+  if (argc >= 8) {
+    searchRadius = atof(argv[7]);
   }
 	BarnesKey treeRoot=1;
 
-	//tree of the depth d
-	BarnesParaTree t(depth);
+  // Record phases for a timeline if PARATREET_TRACE names a file
+  const char *traceFile = ParaTreeT::traceFileFromEnv();
+  ParaTreeT::traceEnable(traceFile != NULL);
 
   // Record start time
   auto t1 = std::chrono::high_resolution_clock::now();
 
-	//recursively construct tree starting from the root
-	DEBUG(cout<<"*********BUILDING TREE*********\n";)
-	t.constructNode(treeRoot, vector3d(0.0, 0.0, 0.0), vector3d(100.0, 100.0, 100.0));
+	BarnesParaTree *mapped = NULL;
+	if (treeFile) {
+		mapped = new BarnesParaTree(treeFile);
+		if (!mapped->tree) { delete mapped; mapped = NULL; }
+	}
+	//tree of the depth d, unless mapped from the file
+	BarnesParaTree &t = mapped ? *mapped : *new BarnesParaTree(depth);
+
+	if (mapped) {
+		std::cout << "Mapped " << t.depth << "-level tree from " << treeFile << std::endl;
+	}
+	else {
+		//recursively construct tree starting from the root
+		DEBUG(cout<<"*********BUILDING TREE*********\n";)
+		if (snapshot) {
+			t.load(*snapshot);
+			std::cout << "Loaded " << snapshot->count << " particles into a " << t.depth << "-level tree" << std::endl;
+			delete snapshot;
+		}
+		else {
+			PARATREET_TRACE_PHASE("build");
+			t.constructNode(treeRoot, vector3d(0.0, 0.0, 0.0), vector3d(100.0, 100.0, 100.0));
+		}
+		if (treeFile) {
+			PARATREET_TRACE_PHASE("save tree");
+			if (!t.save(treeFile))
+				printf("BarnesParaTree: could not save tree to %s\n", treeFile);
+		}
+	}
 
 	//traverse the tree starting from the root
 	DEBUG(cout<<"*********TRAVERSING TREE*********\n";)
 	DEBUG(t.printSubTree(treeRoot);)
 
 	DEBUG(cout<<"*********COMPUTING GRAVITY*********\n";)
-	//Iterate over all leaves and compute their gravity and print accelerations
+	//Iterate over all leaves and compute their gravity; acc is indexed by key - firstLeaf
+	BarnesAccelerations<float> acc(t.size - t.firstLeaf);
+	double walkStart = ParaTreeT::traceBegin();
 	for(int i=0;i<t.size;i++){
 		//check if the node is a leaf
 		if(t.isLeaf(i)){
 			BarnesConsumer<__typeof__(t),BarnesKey> c(t, t.tree[i]);
 			t.requestKey(treeRoot, c);
-			DEBUG(cout<<"Particle "<<i<<" has an acceleration of "<<c.acc<<endl;)
+			acc.store(i - t.firstLeaf, c);
+			DEBUG(cout<<"Particle "<<i<<" has an acceleration of "<<c.ax<<", "<<c.ay<<", "<<c.az<<endl;)
 		}
 	}
+	ParaTreeT::traceEnd("walk", walkStart);
 
   // Record end time
   auto t2 = std::chrono::high_resolution_clock::now();
@@ -41,4 +116,139 @@ int main(int argc, char *argv[]){
 
   // Print time
   std::cout << "Execution time: " << t_diff << " ms" << std::endl;
+  PARATREET_STAT(ParaTreeT::totalStats().print("Traversal statistics");)
+  PARATREET_STAT(ParaTreeT::clearStats();)
+
+  if (resultFile) {
+    PARATREET_TRACE_PHASE("output");
+    auto t7 = std::chrono::high_resolution_clock::now();
+    // SoA columns in leaf order: x, y and z acceleration, then potential
+    ParaTreeT::ResultBuffer results;
+    results.put(acc.ax.data(), acc.size());
+    results.put(acc.ay.data(), acc.size());
+    results.put(acc.az.data(), acc.size());
+    results.put(acc.phi.data(), acc.size());
+    if (ParaTreeT::writeResultFile(resultFile, results)) {
+      auto t8 = std::chrono::high_resolution_clock::now();
+      std::cout << "Output time: " << std::chrono::duration_cast<std::chrono::microseconds>(t8 - t7).count()
+                << " us for " << results.size() << " bytes" << std::endl;
+    }
+  }
+
+  if (compare) {
+    double compressStart = ParaTreeT::traceBegin();
+    BarnesCompressedParaTree ct(t, vector3d(0.0, 0.0, 0.0), vector3d(100.0, 100.0, 100.0));
+    ParaTreeT::traceEnd("compress", compressStart);
+    auto t3 = std::chrono::high_resolution_clock::now();
+    double compressedWalkStart = ParaTreeT::traceBegin();
+    double maxError = 0.0, sumSquaredError = 0.0;
+    for(int i=0;i<t.size;i++){
+      if(t.isLeaf(i)){
+        BarnesLeafData me = ct.leaves[i - ct.firstLeaf].unpack(i, ct.rootMin, ct.rootMax);
+        BarnesConsumer<__typeof__(ct),BarnesKey> c(ct, me);
+        ct.requestKey(treeRoot, c);
+        BarnesAccelerations<float> mine(1);
+        mine.store(0, c);
+        double error = mine.error(0, acc, i - t.firstLeaf);
+        maxError = fmax(maxError, error);
+        sumSquaredError += error*error;
+      }
+    }
+    ParaTreeT::traceEnd("compressed walk", compressedWalkStart);
+    auto t4 = std::chrono::high_resolution_clock::now();
+    auto walk = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
+    auto compressedWalk = std::chrono::duration_cast<std::chrono::microseconds>(t4 - t3).count();
+    std::cout << "Tree memory: " << sizeof(BarnesNodeData)*(t.size - 1) << " bytes, compressed "
+              << ct.bytes() << " bytes" << std::endl;
+    std::cout << "Build and walk: " << walk << " us, compressed walk: " << compressedWalk << " us" << std::endl;
+    // Rare large errors come from cells whose opening test flips on rounding
+    std::cout << "Compressed relative acceleration error: max " << maxError
+              << ", rms " << sqrt(sumSquaredError/(t.size - t.firstLeaf)) << std::endl;
+    PARATREET_STAT(ParaTreeT::totalStats().print("Compressed traversal statistics");)
+    PARATREET_STAT(ParaTreeT::clearStats();)
+  }
+  if (treeFile && pagedBudget > 0) {
+    auto t5 = std::chrono::high_resolution_clock::now();
+    BarnesPagedParaTree pt(treeFile, pagedBudget*1024);
+    if (pt.ok()) {
+      BarnesAccelerations<float> pagedAcc;
+      pt.computeGravity(pagedAcc, 4096);
+      auto t6 = std::chrono::high_resolution_clock::now();
+      double maxDifference = 0.0;
+      for (int i = 0; i < acc.size(); i++)
+        maxDifference = fmax(maxDifference, pagedAcc.error(i, acc, i));
+      std::cout << "Paged walk: " << std::chrono::duration_cast<std::chrono::microseconds>(t6 - t5).count()
+                << " us, max relative difference " << maxDifference << std::endl;
+      pt.printStats();
+      PARATREET_STAT(ParaTreeT::totalStats().print("Paged traversal statistics");)
+    }
+  }
+  if (neighbors > 0) {
+    PARATREET_TRACE_PHASE("knn walk");
+    PARATREET_STAT(ParaTreeT::clearStats();)
+    auto t9 = std::chrono::high_resolution_clock::now();
+    double sumRadius = 0.0;
+    long queries = 0, found = 0;
+    for(int i=t.firstLeaf;i<t.size;i++){
+      if(t.tree[i].mass <= 0.0f) continue; // padding
+      KnnConsumer<__typeof__(t),BarnesKey> c(t, t.tree[i], neighbors);
+      t.requestKey(treeRoot, c);
+      sumRadius += c.radius();
+      queries++;
+      found += c.count;
+    }
+    auto t10 = std::chrono::high_resolution_clock::now();
+    std::cout << "Nearest neighbours: " << found << " found in "
+              << std::chrono::duration_cast<std::chrono::microseconds>(t10 - t9).count()
+              << " us, mean distance to the farthest " << sumRadius/queries << std::endl;
+    PARATREET_STAT(ParaTreeT::totalStats().print("Nearest neighbour traversal statistics");)
+  }
+  if (searchRadius > 0.0f) {
+    BarnesNodeCounts<BarnesKey> counts;
+    {
+      PARATREET_TRACE_PHASE("node counts");
+      counts.compute(t.tree, t.size, t.firstLeaf);
+    }
+    // Listing: every neighbour's key, in one array reused by all the queries
+    PARATREET_STAT(ParaTreeT::clearStats();)
+    auto t11 = std::chrono::high_resolution_clock::now();
+    std::vector<BarnesKey> keys;
+    long listed = 0;
+    {
+      PARATREET_TRACE_PHASE("ball walk");
+      for(int i=t.firstLeaf;i<t.size;i++){
+        if(t.tree[i].mass <= 0.0f) continue; // padding
+        keys.clear();
+        Ball3dConsumer<__typeof__(t),BarnesKey,Ball3dNeighborList<BarnesKey> > c(t, t.tree[i], searchRadius,
+            counts, Ball3dNeighborList<BarnesKey>(&keys));
+        t.requestKey(treeRoot, c);
+        listed += keys.size();
+      }
+    }
+    auto t12 = std::chrono::high_resolution_clock::now();
+    PARATREET_STAT(ParaTreeT::totalStats().print("Ball search traversal statistics");)
+    // Counting: whole nodes inside the sphere add their particle count
+    PARATREET_STAT(ParaTreeT::clearStats();)
+    long counted = 0;
+    {
+      PARATREET_TRACE_PHASE("ball count walk");
+      for(int i=t.firstLeaf;i<t.size;i++){
+        if(t.tree[i].mass <= 0.0f) continue; // padding
+        Ball3dConsumer<__typeof__(t),BarnesKey> c(t, t.tree[i], searchRadius, counts);
+        t.requestKey(treeRoot, c);
+        counted += c.neighbors.count;
+      }
+    }
+    auto t13 = std::chrono::high_resolution_clock::now();
+    std::cout << "Ball search: " << listed << " neighbours listed in "
+              << std::chrono::duration_cast<std::chrono::microseconds>(t12 - t11).count() << " us, "
+              << counted << " counted in "
+              << std::chrono::duration_cast<std::chrono::microseconds>(t13 - t12).count() << " us" << std::endl;
+    if (listed != counted)
+      printf("Ball search: listed and counted neighbours differ\n");
+    PARATREET_STAT(ParaTreeT::totalStats().print("Ball count traversal statistics");)
+  }
+  delete &t;
+  if (traceFile && ParaTreeT::writeTraceFile(traceFile))
+    std::cout << "Wrote trace to " << traceFile << std::endl;
 }
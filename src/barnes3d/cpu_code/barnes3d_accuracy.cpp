@@ -0,0 +1,121 @@
+#include "barnes3d_cputree.h"
+#include "barnes3d_direct.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+/// Value at quantile q (0 to 1) of sorted values
+static double quantile(const std::vector<double> &sorted, double q) {
+	return sorted[std::min(sorted.size() - 1, (size_t)(q*sorted.size()))];
+}
+
+/*
+Accuracy against cost: walks a sample of the particles with a range of opening
+thresholds and bucket sizes, and compares their gravity with direct summation.
+Writes one CSV line per setting.
+*/
+int main(int argc, char *argv[]){
+
+	//depth of the tree if a number, else a snapshot file to load (the depth then fits its particles)
+	int depth = 5;
+	ParaTreeT::SnapshotReader *snapshot = NULL;
+  if (argc >= 2) {
+    if (argv[1][0] && strspn(argv[1], "0123456789") == strlen(argv[1]))
+      depth = atoi(argv[1]);
+    else {
+      snapshot = new ParaTreeT::SnapshotReader(argv[1]);
+      if (!snapshot->ok()) return 1;
+      depth = getDepthFor(snapshot->count);
+    }
+  }
+  // Number of particles whose gravity is checked
+  long samples = 1000;
+  if (argc >= 3) {
+    samples = atol(argv[2]);
+  }
+  // CSV file to write (standard output by default)
+  FILE *out = stdout;
+  if (argc >= 4) {
+    out = fopen(argv[3], "w");
+    if (!out) {
+      printf("Could not write %s\n", argv[3]);
+      return 1;
+    }
+  }
+
+	BarnesParaTree t(depth);
+	if (snapshot) {
+		t.load(*snapshot);
+		delete snapshot;
+	}
+	else {
+		t.constructNode(1, vector3d(0.0, 0.0, 0.0), vector3d(100.0, 100.0, 100.0));
+		t.computeMoments(1);
+	}
+
+	// Sample evenly among the leaves holding a particle
+	std::vector<BarnesKey> sample;
+	std::vector<vector3d> targets;
+	long particles = 0;
+	for (int i = t.firstLeaf; i < t.size; i++)
+		if (t.tree[i].mass != 0.0f) particles++;
+	long stride = std::max(1L, particles/std::max(1L, samples));
+	for (int i = t.firstLeaf, n = 0; i < t.size; i++) {
+		if (t.tree[i].mass == 0.0f) continue;
+		if (n++ % stride == 0 && (long)sample.size() < samples) {
+			sample.push_back(i);
+			targets.push_back(t.tree[i].pos);
+		}
+	}
+	if (sample.empty()) { // no particle has mass, or no samples were asked for
+		printf("No particles to sample\n");
+		if (out != stdout) fclose(out);
+		return 1;
+	}
+
+	auto t1 = std::chrono::high_resolution_clock::now();
+	BarnesDirectSum direct(t.tree + t.firstLeaf, t.size - t.firstLeaf);
+	BarnesAccelerations<double> exact;
+	direct.compute(targets, exact);
+	auto t2 = std::chrono::high_resolution_clock::now();
+	fprintf(stderr, "Direct summation: %ld particles on %ld targets in %.3f s\n", particles, (long)targets.size(),
+			std::chrono::duration<double>(t2 - t1).count());
+
+	fprintf(out, "theta,bucket,particles,samples,interactions_per_particle,walk_us_per_particle,"
+			"acc_error_median,acc_error_p99,acc_error_max,phi_error_median\n");
+	const float thetas[] = {0.2f, 0.3f, 0.4f, 0.5f, 0.6f, 0.7f, 0.8f, 1.0f};
+	// Bucket nodes are b levels above the leaves.  A bucket of 8 would change nothing:
+	// an opened parent of leaves always sums its 8 particles directly.
+	const int bucketLevels[] = {0, 2, 3};
+	for (int l = 0; l < 3 && bucketLevels[l] < depth; l++) {
+		int b = bucketLevels[l];
+		int bucket = 1 << (3*b); // particles per bucket
+		int bucketLevel = (b == 0) ? -1 : depth - 1 - b;
+		for (int th = 0; th < sizeof(thetas)/sizeof(thetas[0]); th++) {
+			BarnesAccelerations<float> approx(sample.size());
+			long interactions = 0;
+			auto t3 = std::chrono::high_resolution_clock::now();
+			for (size_t s = 0; s < sample.size(); s++) {
+				BarnesConsumer<BarnesParaTree, BarnesKey> c(t, t.tree[sample[s]], thetas[th], bucketLevel);
+				t.requestKey(1, c);
+				approx.store(s, c);
+				interactions += c.interactions;
+			}
+			auto t4 = std::chrono::high_resolution_clock::now();
+
+			std::vector<double> accError(sample.size()), phiError(sample.size());
+			for (size_t s = 0; s < sample.size(); s++) {
+				accError[s] = approx.error(s, exact, s);
+				phiError[s] = fabs(approx.phi[s] - exact.phi[s])/fabs(exact.phi[s]);
+			}
+			std::sort(accError.begin(), accError.end());
+			std::sort(phiError.begin(), phiError.end());
+			fprintf(out, "%g,%d,%ld,%ld,%g,%g,%g,%g,%g,%g\n", thetas[th], bucket, particles, (long)sample.size(),
+					(double)interactions/sample.size(),
+					std::chrono::duration<double, std::micro>(t4 - t3).count()/sample.size(),
+					quantile(accError, 0.5), quantile(accError, 0.99), accError.back(), quantile(phiError, 0.5));
+		}
+	}
+	if (out != stdout) fclose(out);
+}
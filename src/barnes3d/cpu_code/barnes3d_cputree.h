@@ -10,10 +10,57 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <climits>
 #include <cmath>
 #include <iostream>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 using namespace std;
 #include "barnes3d.h"
+#include "paratreet_snapshot.h"
+#include "paratreet_trace.h"
+
+/// Version of the tree file layout below; bump it on any change
+#define BARNES_TREEFILE_VERSION 1
+
+/// Key policies a tree file can use
+enum BarnesKeyPolicy { BARNES_DENSE_OCTREE_KEYS = 1 }; // root 1, children 8k-6+i, by level
+
+/**
+ Header of a tree file, at offset 0.  Each section starts on a page boundary:
+ the nodes, indexed by key, then the leaf SoA arrays (mass, x, y, z), indexed
+ by key - firstLeaf.  Numbers are stored in the writer's byte order.
+*/
+struct BarnesTreeFileHeader {
+	char magic[8]; // "PTREE3D"
+	int version;
+	int keyPolicy;
+	int nodeBytes; // sizeof(BarnesNodeData) of the writer
+	int depth;
+	long long size, firstLeaf;
+	long long nodeOffset; // byte offset of the node section
+	long long leafOffset[4]; // byte offsets of the leaf mass, x, y and z arrays
+	long long fileBytes;
+
+	/// Does a section of this many bytes at offset lie after the header and inside the file?
+	bool sectionFits(long long offset, long long bytes) const {
+		return offset >= (long long)sizeof(*this) && offset % sizeof(float) == 0
+			&& bytes >= 0 && bytes <= fileBytes - offset;
+	}
+
+	/// Are the tree's shape and sections consistent with a file of fileBytes, so they can be read through?
+	bool sectionsFit() const {
+		if (size < 2 || size > INT_MAX || firstLeaf < 1 || firstLeaf >= size) return false;
+		if (!sectionFits(nodeOffset, size*(long long)sizeof(BarnesNodeData))) return false;
+		for (int a = 0; a < 4; a++)
+			if (!sectionFits(leafOffset[a], (size - firstLeaf)*(long long)sizeof(float))) return false;
+		return true;
+	}
+};
 
 /*
 Barnes Hut Tree : Stores nodes in a dense array
@@ -24,12 +71,108 @@ class BarnesParaTree{
 	int size;
 	BarnesKey firstLeaf;
 	BarnesNodeData *tree;
-	BarnesParaTree(int depth) : depth(depth){
+	/// Leaf SoA arrays, indexed by key - firstLeaf (only for trees opened from a file)
+	const float *leafMass, *leafX, *leafY, *leafZ;
+	/// Mapped tree file, if the tree was opened from one
+	void *mapping;
+	size_t mappingBytes;
+
+	BarnesParaTree(int depth) : depth(depth), leafMass(NULL), leafX(NULL), leafY(NULL), leafZ(NULL), mapping(NULL), mappingBytes(0){
 		size = (int)pow(8, depth)/7 + 1;
 		tree = (BarnesNodeData*)malloc(sizeof(BarnesNodeData)*size);
 		firstLeaf = (BarnesKey)((int)pow(8, depth)/56 + 1);
   }
 
+  /// Map a tree file written by save(), and walk it in place.  tree is NULL if the file can't be used.
+	BarnesParaTree(const char *path) : depth(0), size(0), firstLeaf(0), tree(NULL),
+		leafMass(NULL), leafX(NULL), leafY(NULL), leafZ(NULL), mapping(NULL), mappingBytes(0){
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0) return;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(BarnesTreeFileHeader)) {
+			mappingBytes = st.st_size;
+			mapping = mmap(NULL, mappingBytes, PROT_READ, MAP_SHARED, fd, 0);
+			if (mapping == MAP_FAILED) mapping = NULL;
+		}
+		close(fd);
+		if (!mapping) return;
+
+		const BarnesTreeFileHeader *h = (const BarnesTreeFileHeader *)mapping;
+		if (strncmp(h->magic, "PTREE3D", 8) != 0 || h->version != BARNES_TREEFILE_VERSION
+				|| h->keyPolicy != BARNES_DENSE_OCTREE_KEYS || h->nodeBytes != (int)sizeof(BarnesNodeData)
+				|| h->fileBytes != (long long)mappingBytes || !h->sectionsFit()) {
+			printf("BarnesParaTree: %s is not a usable version %d tree file\n", path, BARNES_TREEFILE_VERSION);
+			munmap(mapping, mappingBytes);
+			mapping = NULL;
+			return;
+		}
+		depth = h->depth;
+		size = (int)h->size;
+		firstLeaf = (BarnesKey)h->firstLeaf;
+		const char *base = (const char *)mapping;
+		// The mapping is read-only: walks only read the tree
+		tree = (BarnesNodeData *)(base + h->nodeOffset);
+		leafMass = (const float *)(base + h->leafOffset[0]);
+		leafX = (const float *)(base + h->leafOffset[1]);
+		leafY = (const float *)(base + h->leafOffset[2]);
+		leafZ = (const float *)(base + h->leafOffset[3]);
+	}
+
+	~BarnesParaTree() {
+		if (mapping) munmap(mapping, mappingBytes);
+		else free(tree);
+	}
+
+	/// The tree owns its nodes or mapping: it can't be copied
+	BarnesParaTree(const BarnesParaTree &) = delete;
+	BarnesParaTree &operator=(const BarnesParaTree &) = delete;
+
+  /// A mapped tree is read-only: it can be walked, but not loaded or constructed.  Prints why if so.
+	bool readOnly() const {
+		if (mapping) printf("BarnesParaTree: a tree mapped from a file can't be changed\n");
+		return mapping != NULL;
+	}
+
+	/// Write the tree to a file that BarnesParaTree(path) maps back.  Returns false on I/O errors.
+	bool save(const char *path) const {
+		long long page = sysconf(_SC_PAGESIZE);
+		BarnesTreeFileHeader h;
+		memset(&h, 0, sizeof(h));
+		strncpy(h.magic, "PTREE3D", sizeof(h.magic));
+		h.version = BARNES_TREEFILE_VERSION;
+		h.keyPolicy = BARNES_DENSE_OCTREE_KEYS;
+		h.nodeBytes = sizeof(BarnesNodeData);
+		h.depth = depth;
+		h.size = size;
+		h.firstLeaf = firstLeaf;
+		long long nLeaves = size - firstLeaf;
+		long long offset = page;
+		h.nodeOffset = offset;
+		offset += (sizeof(BarnesNodeData)*size + page - 1)/page*page;
+		for (int a = 0; a < 4; a++) {
+			h.leafOffset[a] = offset;
+			offset += (sizeof(float)*nLeaves + page - 1)/page*page;
+		}
+		h.fileBytes = offset;
+
+		FILE *f = fopen(path, "wb");
+		if (!f) return false;
+		bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+		ok = ok && fseek(f, h.nodeOffset, SEEK_SET) == 0 && fwrite(tree, sizeof(BarnesNodeData), size, f) == (size_t)size;
+		std::vector<float> column(nLeaves);
+		for (int a = 0; a < 4 && ok; a++) {
+			for (long long i = 0; i < nLeaves; i++) {
+				const BarnesNodeData &l = tree[firstLeaf + i];
+				column[i] = (a == 0) ? l.mass : (a == 1) ? l.pos.x : (a == 2) ? l.pos.y : l.pos.z;
+			}
+			ok = fseek(f, h.leafOffset[a], SEEK_SET) == 0 && fwrite(column.data(), sizeof(float), nLeaves, f) == (size_t)nLeaves;
+		}
+		// Pad the last section to its page boundary, so the file is exactly fileBytes long
+		if (ok && ftell(f) < h.fileBytes)
+			ok = fseek(f, h.fileBytes - 1, SEEK_SET) == 0 && fputc(0, f) != EOF;
+		return (fclose(f) == 0) && ok;
+	}
+
   inline bool isLeaf(int index) {
     return (index >= firstLeaf);
   }
@@ -37,6 +180,8 @@ class BarnesParaTree{
 	//Process node requests and send back nodes/leaves
 	template <class Consumer>
 	void requestKey(BarnesKey bk, Consumer &c){
+		PARATREET_STACK_DEPTH;
+		PARATREET_COUNT(STAT_WALKS, bk == 1);
 		if(bk<1 || bk>= size) printf("BarnesParaTree: Requested INVALID tree node %d\n", (int)bk);
 		else{
 			if(bk>=firstLeaf)
@@ -53,8 +198,41 @@ class BarnesParaTree{
     }
 	}
 
-  /// Recursively construct tree
+  /// Fill the leaves with the particles of a snapshot, in Morton order, then compute the moments above them.
+  /// Returns false, leaving the tree as it was, if it is mapped from a file.
+	bool load(ParaTreeT::SnapshotReader &snapshot) {
+		if (readOnly()) return false;
+		BarnesLeafSink sink(tree + firstLeaf, NULL, 0);
+		{
+			PARATREET_TRACE_PHASE("read particles");
+			snapshot.read(0, size - firstLeaf, sink);
+		}
+		{
+			PARATREET_TRACE_PHASE("build");
+			sortLeavesMorton(tree + firstLeaf, NULL, sink.filled);
+			sink.pad(size - firstLeaf, vector3d(0.0, 0.0, 0.0));
+		}
+		PARATREET_TRACE_PHASE("upward pass");
+		computeMoments(1);
+		return true;
+	}
+
+  /// Recursively compute the moments of the interior nodes below this one
+	void computeMoments(BarnesKey index) {
+		if (isLeaf(index)) return;
+		BarnesNodeData n = emptyMoments();
+		for (int i = 0; i < 8; i++) {
+			BarnesKey child = getChild(index, i);
+			computeMoments(child);
+			addMoments(n, tree[child]);
+		}
+		finishMoments(n);
+		tree[index] = n;
+	}
+
+  /// Recursively construct tree (not if it is mapped from a file)
 	void constructNode(int index, vector3d min, vector3d max){
+		if (readOnly()) return;
     // Interior node
     if (!isLeaf(index)) {
       vector3d mid = (min+max)/2;
@@ -98,4 +276,64 @@ class BarnesParaTree{
 
 };
 
+/*
+Compressed Barnes Hut Tree : the same dense array layout, with nodes and leaves
+packed as 16-bit fixed point inside their cells (BarnesPackedNode/BarnesPackedLeaf),
+and unpacked on the fly as they are requested.
+*/
+class BarnesCompressedParaTree{
+	public:
+	int depth;
+	int size;
+	BarnesKey firstLeaf;
+	vector3d rootMin, rootMax;
+	BarnesPackedNode *nodes; // indexed by key, below firstLeaf
+	BarnesPackedLeaf *leaves; // indexed by key - firstLeaf
+
+	BarnesCompressedParaTree(const BarnesParaTree &t, vector3d rootMin, vector3d rootMax) :
+		depth(t.depth), size(t.size), firstLeaf(t.firstLeaf), rootMin(rootMin), rootMax(rootMax) {
+		nodes = (BarnesPackedNode*)malloc(sizeof(BarnesPackedNode)*firstLeaf);
+		leaves = (BarnesPackedLeaf*)malloc(sizeof(BarnesPackedLeaf)*(size - firstLeaf));
+		for (BarnesKey k = 1; k < firstLeaf; k++)
+			nodes[k] = BarnesPackedNode(t.tree[k], k, rootMin, rootMax);
+		for (BarnesKey k = firstLeaf; k < size; k++)
+			leaves[k - firstLeaf] = BarnesPackedLeaf(t.tree[k], k, rootMin, rootMax);
+	}
+
+	~BarnesCompressedParaTree() {
+		free(nodes);
+		free(leaves);
+	}
+
+	/// Memory used by the packed nodes and leaves
+	size_t bytes() const {
+		return sizeof(BarnesPackedNode)*(firstLeaf - 1) + sizeof(BarnesPackedLeaf)*(size - firstLeaf);
+	}
+
+	inline bool isLeaf(int index) {
+		return (index >= firstLeaf);
+	}
+
+	//Unpack requested nodes/leaves and send them back
+	template <class Consumer>
+	void requestKey(BarnesKey bk, Consumer &c){
+		PARATREET_STACK_DEPTH;
+		PARATREET_COUNT(STAT_WALKS, bk == 1);
+		if(bk<1 || bk>= size) printf("BarnesCompressedParaTree: Requested INVALID tree node %d\n", (int)bk);
+		else{
+			if(bk>=firstLeaf)
+				c.consumeLeaf(leaves[bk - firstLeaf].unpack(bk, rootMin, rootMax),bk);
+			else
+				c.consumeNode(nodes[bk].unpack(bk, rootMin, rootMax),bk);
+		}
+	}
+
+	template <class Consumer>
+	void requestChildren(BarnesKey bk, Consumer &c){
+		for (int i = 0; i < 8; i++) {
+			requestKey(getChild(*this, bk, i), c);
+		}
+	}
+};
+
 #endif
@@ -0,0 +1,69 @@
+/* 3D barnes-hut example
+	 Direct summation reference
+*/
+
+#ifndef __PARATREET_BARNES3D_DIRECT
+#define __PARATREET_BARNES3D_DIRECT
+
+#include "barnes3d.h"
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+/*
+Direct summation: the exact gravity of every source particle on a set of
+targets, with BarnesConsumer's softening, in double precision.  Sources are
+kept as SoA arrays so the inner loop vectorizes; targets are split between
+threads.
+*/
+class BarnesDirectSum{
+	public:
+	std::vector<double> mass, x, y, z;
+
+	/// Take the particles with mass from the leaves of a dense tree
+	BarnesDirectSum(const BarnesNodeData *leaves, long n) {
+		for (long i = 0; i < n; i++) {
+			if (leaves[i].mass == 0.0f) continue;
+			mass.push_back(leaves[i].mass);
+			x.push_back(leaves[i].pos.x);
+			y.push_back(leaves[i].pos.y);
+			z.push_back(leaves[i].pos.z);
+		}
+	}
+
+	/// Compute the acceleration and potential at each target position into out
+	void compute(const std::vector<vector3d> &targets, BarnesAccelerations<double> &out, int threads = 0) {
+		out.resize(targets.size());
+		if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+		std::vector<std::thread> workers;
+		for (int t = 0; t < threads; t++)
+			workers.push_back(std::thread(&BarnesDirectSum::computeRange, this, std::cref(targets), std::ref(out),
+					targets.size()*t/threads, targets.size()*(t + 1)/threads));
+		for (int t = 0; t < threads; t++)
+			workers[t].join();
+	}
+
+	private:
+	void computeRange(const std::vector<vector3d> &targets, BarnesAccelerations<double> &out, size_t first, size_t last) {
+		const double G = 1.0, SOFTENING = 0.00001; // as in BarnesConsumer::addGravity
+		const double *m = mass.data(), *px = x.data(), *py = y.data(), *pz = z.data();
+		long n = mass.size();
+		for (size_t i = first; i < last; i++) {
+			double tx = targets[i].x, ty = targets[i].y, tz = targets[i].z;
+			double ax = 0, ay = 0, az = 0, phi = 0;
+			for (long j = 0; j < n; j++) {
+				double dx = px[j] - tx, dy = py[j] - ty, dz = pz[j] - tz;
+				double r2 = dx*dx + dy*dy + dz*dz;
+				double gm = G*m[j]/(r2*sqrt(r2) + SOFTENING);
+				ax += gm*dx;
+				ay += gm*dy;
+				az += gm*dz;
+				phi -= gm*r2;
+			}
+			out.ax[i] = ax; out.ay[i] = ay; out.az[i] = az;
+			out.phi[i] = phi;
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,270 @@
+/* 3D barnes-hut example
+	 Out-of-core CPU tree, paged in from a tree file
+*/
+
+#ifndef __PARATREET_BARNES3D_PAGEDTREE
+#define __PARATREET_BARNES3D_PAGEDTREE
+
+#include "barnes3d_cputree.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+Paged Barnes Hut Tree : walks a tree file written by BarnesParaTree::save without
+loading it.  Nodes are read in pages of nodesPerPage consecutive keys into an LRU
+cache of at most budgetPages pages.  A request for a key whose page is not resident
+suspends that branch of the consumer's walk until an I/O thread has read the page;
+meanwhile the walk goes on with the other consumers of the batch.
+*/
+class BarnesPagedParaTree{
+	public:
+	int depth;
+	int size;
+	BarnesKey firstLeaf;
+	int nodesPerPage;
+	size_t budgetPages;
+
+	/// Page cache statistics: requests served from a resident page, requests suspended
+	/// on a missing page, pages read (page faults), and pages evicted
+	long hits, misses, reads, evictions;
+
+	/// Open a tree file, caching at most budgetBytes of its nodes.  ok() is false if the file can't be used.
+	BarnesPagedParaTree(const char *path, size_t budgetBytes, int pageBytes = 65536) :
+		depth(0), size(0), firstLeaf(0), hits(0), misses(0), reads(0), evictions(0), fd(-1), inFlight(0), stopping(false){
+		nodesPerPage = std::max(1, pageBytes/(int)sizeof(BarnesNodeData));
+		budgetPages = std::max((size_t)1, budgetBytes/(nodesPerPage*sizeof(BarnesNodeData)));
+		fd = ::open(path, O_RDONLY);
+		if (fd < 0) return;
+		BarnesTreeFileHeader h;
+		struct stat st;
+		if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) || strncmp(h.magic, "PTREE3D", 8) != 0
+				|| h.version != BARNES_TREEFILE_VERSION || h.keyPolicy != BARNES_DENSE_OCTREE_KEYS
+				|| h.nodeBytes != (int)sizeof(BarnesNodeData)
+				|| fstat(fd, &st) != 0 || h.fileBytes != (long long)st.st_size || !h.sectionsFit()) {
+			printf("BarnesPagedParaTree: %s is not a usable version %d tree file\n", path, BARNES_TREEFILE_VERSION);
+			close(fd);
+			fd = -1;
+			return;
+		}
+		depth = h.depth;
+		size = (int)h.size;
+		firstLeaf = (BarnesKey)h.firstLeaf;
+		nodeOffset = h.nodeOffset;
+		for (int a = 0; a < 4; a++) leafOffset[a] = h.leafOffset[a];
+		io = std::thread(&BarnesPagedParaTree::ioLoop, this);
+	}
+
+	~BarnesPagedParaTree() {
+		if (fd < 0) return;
+		{
+			std::lock_guard<std::mutex> l(lock);
+			stopping = true;
+		}
+		wake.notify_one();
+		io.join();
+		for (std::unordered_map<long, Page*>::iterator it = resident.begin(); it != resident.end(); it++)
+			delete it->second;
+		close(fd);
+	}
+
+	bool ok() const { return fd >= 0; }
+
+  inline bool isLeaf(int index) {
+    return (index >= firstLeaf);
+  }
+
+	//Process node requests from resident pages; suspend them on missing pages
+	template <class Consumer>
+	void requestKey(BarnesKey bk, Consumer &c){
+		PARATREET_STACK_DEPTH;
+		if(bk<1 || bk>= size) {
+			printf("BarnesPagedParaTree: Requested INVALID tree node %d\n", (int)bk);
+			return;
+		}
+		long page = bk/nodesPerPage;
+		std::unordered_map<long, Page*>::iterator it = resident.find(page);
+		if (it != resident.end()) {
+			hits++;
+			PARATREET_COUNT(STAT_CACHE_HITS, 1);
+			PARATREET_COUNT(STAT_WALKS, bk == 1); // suspended requests are counted once they run
+			lru.splice(lru.begin(), lru, it->second->lru);
+			const BarnesNodeData &n = it->second->nodes[bk - page*nodesPerPage];
+			if(bk>=firstLeaf)
+				c.consumeLeaf(n,bk);
+			else
+				c.consumeNode(n,bk);
+		}
+		else {
+			misses++;
+			PARATREET_COUNT(STAT_CACHE_MISSES, 1);
+			std::vector<std::function<void()> > &w = waiting[page];
+			if (w.empty()) wanted.push_back(page); // first request for this page
+			w.push_back([this, bk, &c]() { requestKey(bk, c); });
+		}
+	}
+
+	template <class Consumer>
+	void requestChildren(BarnesKey bk, Consumer &c){
+    for (int i = 0; i < 8; i++) {
+      requestKey(getChild(*this, bk, i), c);
+    }
+	}
+
+	/// Compute gravity on every leaf, batch leaves at a time; acc is indexed by key - firstLeaf
+	void computeGravity(BarnesAccelerations<float> &acc, int batch) {
+		long nLeaves = size - firstLeaf;
+		acc.resize(nLeaves);
+		std::vector<BarnesLeafData> me;
+		std::vector<BarnesConsumer<BarnesPagedParaTree, BarnesKey> > consumers;
+		for (long start = 0; start < nLeaves; start += batch) {
+			long n = std::min((long)batch, nLeaves - start);
+			PARATREET_TRACE_PHASE("paged walk");
+			readLeaves(start, n, me);
+			consumers.clear();
+			consumers.reserve(n); // suspended requests refer to the consumers in place
+			for (long i = 0; i < n; i++)
+				consumers.push_back(BarnesConsumer<BarnesPagedParaTree, BarnesKey>(*this, me[i]));
+			for (long i = 0; i < n; i++)
+				requestKey(1, consumers[i]);
+			drain();
+			for (long i = 0; i < n; i++)
+				acc.store(start + i, consumers[i]);
+		}
+	}
+
+	void printStats() {
+		printf("Paged tree: %ld pages of %d nodes cached, %ld hits, %ld suspended requests, %ld page reads, %ld evictions\n",
+				(long)budgetPages, nodesPerPage, hits, misses, reads, evictions);
+	}
+
+	private:
+	struct Page {
+		std::vector<BarnesNodeData> nodes;
+		std::list<long>::iterator lru;
+	};
+
+	/// Resident pages, and their use order (most recent first)
+	std::unordered_map<long, Page*> resident;
+	std::list<long> lru;
+
+	/// Requests suspended on each missing page, and the missing pages not yet being read
+	std::unordered_map<long, std::vector<std::function<void()> > > waiting;
+	std::deque<long> wanted;
+
+	int fd;
+	long long nodeOffset, leafOffset[4];
+
+	/// I/O thread: reads queued pages and hands them back through done
+	std::thread io;
+	std::mutex lock;
+	std::condition_variable wake, readDone;
+	std::deque<std::pair<long, Page*> > queued, done;
+	size_t inFlight;
+	bool stopping;
+
+	/// Run suspended requests until all of them have finished, reading pages as needed
+	void drain() {
+		while (!waiting.empty()) {
+			// Read wanted pages while the budget allows, making room by evicting the least recently used
+			while (!wanted.empty() && inFlight < budgetPages) {
+				if (resident.size() + inFlight >= budgetPages) {
+					if (resident.empty()) break;
+					evict();
+				}
+				issue(wanted.front());
+				wanted.pop_front();
+			}
+			// Install the next page read, and resume the requests that waited for it
+			std::pair<long, Page*> r;
+			{
+				std::unique_lock<std::mutex> l(lock);
+				readDone.wait(l, [this]{ return !done.empty(); });
+				r = done.front();
+				done.pop_front();
+			}
+			inFlight--;
+			lru.push_front(r.first);
+			r.second->lru = lru.begin();
+			resident[r.first] = r.second;
+			std::vector<std::function<void()> > resume;
+			resume.swap(waiting[r.first]);
+			waiting.erase(r.first);
+			for (size_t i = 0; i < resume.size(); i++)
+				resume[i]();
+		}
+	}
+
+	void evict() {
+		long page = lru.back();
+		lru.pop_back();
+		delete resident[page];
+		resident.erase(page);
+		evictions++;
+	}
+
+	void issue(long page) {
+		Page *p = new Page;
+		p->nodes.resize(std::min((long)nodesPerPage, size - page*nodesPerPage));
+		reads++;
+		PARATREET_COUNT(STAT_REMOTE_REQUESTS, 1);
+		PARATREET_COUNT(STAT_BYTES_RECEIVED, p->nodes.size()*sizeof(BarnesNodeData));
+		inFlight++;
+		{
+			std::lock_guard<std::mutex> l(lock);
+			queued.push_back(std::make_pair(page, p));
+		}
+		wake.notify_one();
+	}
+
+	void ioLoop() {
+		std::unique_lock<std::mutex> l(lock);
+		while (true) {
+			wake.wait(l, [this]{ return stopping || !queued.empty(); });
+			if (stopping) return;
+			std::pair<long, Page*> r = queued.front();
+			queued.pop_front();
+			l.unlock();
+			double start = ParaTreeT::traceBegin();
+			readFully(r.second->nodes.data(), r.second->nodes.size()*sizeof(BarnesNodeData),
+					nodeOffset + (long long)r.first*nodesPerPage*sizeof(BarnesNodeData));
+			ParaTreeT::traceEnd("page read", start);
+			l.lock();
+			done.push_back(r);
+			readDone.notify_one();
+		}
+	}
+
+	/// Read the particles of leaves start to start+n-1 from the leaf arrays
+	void readLeaves(long start, long n, std::vector<BarnesLeafData> &me) {
+		std::vector<float> column[4];
+		for (int a = 0; a < 4; a++) {
+			column[a].resize(n);
+			readFully(column[a].data(), n*sizeof(float), leafOffset[a] + start*sizeof(float));
+		}
+		me.resize(n);
+		for (long i = 0; i < n; i++)
+			me[i] = BarnesLeafData(column[0][i], vector3d(column[1][i], column[2][i], column[3][i]));
+	}
+
+	void readFully(void *buf, size_t bytes, long long offset) {
+		char *p = (char *)buf;
+		while (bytes > 0) {
+			ssize_t got = pread(fd, p, bytes, offset);
+			if (got <= 0) {
+				printf("BarnesPagedParaTree: read failed at offset %lld\n", offset);
+				memset(p, 0, bytes);
+				return;
+			}
+			p += got; bytes -= got; offset += got;
+		}
+	}
+};
+
+#endif
@@ -34,7 +34,7 @@ __global__ void tryTraverse(const BarnesNodeData *treeNodes, int firstLeaf, int
     tree.iterateToConsumer(c);
 #endif
 
-    acc[i] = c.acc;
+    acc[i] = sqrt(c.ax*c.ax + c.ay*c.ay + c.az*c.az); // magnitude of the acceleration
   }
 }
 
@@ -0,0 +1,126 @@
+/**
+ * 3D k-nearest-neighbour search consumer, on the Barnes-Hut octree.
+ */
+#ifndef __PARATREET_KNN3D
+#define __PARATREET_KNN3D
+
+#include "barnes3d.h"
+
+/**
+ * A k-nearest-neighbour consumer: finds the k leaves nearest to me (itself
+ * included, if it is in the tree), up to Capacity of them.
+ *
+ * Candidates go into a fixed-capacity max-heap on squared distance.  Once it
+ * holds k, the search radius shrinks to the farthest of them, and nodes whose
+ * box is farther than that are pruned without being opened.  The radius only
+ * shrinks, so a node pruned while remote replies are still arriving is never
+ * needed later.  Massless leaves (the padding after the particles) are skipped.
+ */
+template <class ParaTree,class BarnesKey,int Capacity = 64>
+struct KnnConsumer {
+public:
+	ParaTree &tree;
+	const BarnesLeafData &me;
+	int k; // neighbours wanted, at most Capacity
+	int count; // neighbours found so far
+	float radius2; // squared search radius: the farthest neighbour once count reaches k
+	float dist2[Capacity]; // max-heap of neighbours on squared distance (sorted nearest first by sort())
+	BarnesKey keys[Capacity];
+
+	/// A consumer finding the k nearest leaves, none farther than maxRadius
+	CUDA_BOTH KnnConsumer(ParaTree &tree,const BarnesLeafData &me,int k,float maxRadius = FLT_MAX)
+		:tree(tree), me(me), k(k < Capacity ? k : Capacity), count(0),
+		 radius2(maxRadius < FLT_MAX ? maxRadius*maxRadius : FLT_MAX) {}
+
+/// Packing-unpacking of the search state; tree and me are rebound by the owner
+#ifdef __CHARMC__
+	void pup(PUP::er &p) {
+		p|k;
+		p|count;
+		p|radius2;
+		PUParray(p, dist2, Capacity);
+		PUParray(p, keys, Capacity);
+	}
+#endif
+
+	/// Distance to the farthest neighbour found (the search radius, until k are found)
+	inline CUDA_BOTH float radius() const {
+		return sqrt(radius2);
+	}
+
+	/// Consume a tree node: opens it unless its box is beyond the search radius.
+	inline CUDA_BOTH void consumeNode(const BarnesNodeData &n, const BarnesKey &key) {
+		PARATREET_COUNT(STAT_NODES_VISITED, 1);
+		if (n.mass <= 0.0f || boxDistance2(me.pos, n.min, n.max) > radius2)
+			return; // empty, or too far to hold a neighbour
+		TRACE_BARNES(printf("Me = (%6.2f, %6.2f, %6.2f), opening node %d (radius %.2f)\n",
+				me.pos.x, me.pos.y, me.pos.z, key, radius()));
+		PARATREET_COUNT(STAT_NODES_OPENED, 1);
+		// Children are (roughly) octants of their parent: start with the one toward me and end
+		// with the opposite one, so the radius has shrunk by the time the far ones come.
+		// Any order finds the same neighbours.
+		vector3d mid = (n.min + n.max)/2;
+		int near = (me.pos.x > mid.x) | (me.pos.y > mid.y) << 1 | (me.pos.z > mid.z) << 2;
+		const int flips[8] = {0, 1, 2, 4, 3, 5, 6, 7};
+		for (int i = 0; i < 8; i++)
+			tree.requestKey(getChild(tree, key, near ^ flips[i]), *this);
+	}
+
+	/// Consume a tree leaf: a candidate neighbour.
+	inline CUDA_BOTH void consumeLeaf(const BarnesLeafData &l, const BarnesKey &key) {
+		PARATREET_COUNT(STAT_NODES_VISITED, 1);
+		PARATREET_COUNT(STAT_LEAF_INTERACTIONS, 1);
+		if (l.mass <= 0.0f) return;
+		float d2 = distance2(me.pos, l.pos);
+		if (count < k) {
+			if (d2 > radius2) return;
+			push(d2, key);
+			if (count == k) radius2 = dist2[0];
+		}
+		else if (k > 0 && d2 < radius2) {
+			dist2[0] = d2;
+			keys[0] = key;
+			siftDown(0, count);
+			radius2 = dist2[0];
+		}
+	}
+
+	/// Sort the neighbours nearest first, once the walk is over (by heapsort, in place)
+	CUDA_BOTH void sort() {
+		for (int n = count - 1; n > 0; n--) {
+			swap(0, n);
+			siftDown(0, n);
+		}
+	}
+
+private:
+	inline CUDA_BOTH void swap(int i, int j) {
+		float d = dist2[i]; dist2[i] = dist2[j]; dist2[j] = d;
+		BarnesKey t = keys[i]; keys[i] = keys[j]; keys[j] = t;
+	}
+
+	/// Add a neighbour to the heap, which isn't full
+	inline CUDA_BOTH void push(float d2, const BarnesKey &key) {
+		int i = count++;
+		dist2[i] = d2;
+		keys[i] = key;
+		while (i > 0 && dist2[(i - 1)/2] < dist2[i]) {
+			swap(i, (i - 1)/2);
+			i = (i - 1)/2;
+		}
+	}
+
+	/// Restore the heap order below i, among the first n entries
+	inline CUDA_BOTH void siftDown(int i, int n) {
+		while (true) {
+			int largest = i, l = 2*i + 1, r = 2*i + 2;
+			if (l < n && dist2[l] > dist2[largest]) largest = l;
+			if (r < n && dist2[r] > dist2[largest]) largest = r;
+			if (largest == i) return;
+			swap(i, largest);
+			i = largest;
+		}
+	}
+};
+
+#endif
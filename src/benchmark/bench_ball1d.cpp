@@ -0,0 +1,40 @@
+#include "../ball1d/cpu_code/ball1d_cputree.h"
+#include "benchmark.h"
+
+/// Neighbours each particle would find if the particles were spread evenly
+#define BENCH_BALL_NEIGHBORS 32
+
+/*
+1D ball search: the tree's own load puts the sorted x coordinates into the
+leaves, with a search radius that holds BENCH_BALL_NEIGHBORS particles at
+the mean density, and computes the cells and split points above them;
+every particle then searches the tree from the root, into CSR neighbour
+lists.  Interactions are the neighbours found.
+*/
+BenchResult benchBall1d(const BenchParticles &p, int trials) {
+	BenchResult r;
+	r.tree = "ball1d";
+	r.particles = p.size();
+	r.depth = benchDepth1d(p.size());
+	BallParaTree t(r.depth);
+	float radius = BENCH_BALL_NEIGHBORS/2*BenchParticles::BOX/p.size();
+	BallNeighborLists<BallKey> lists; // reused, so only the first trial allocates them
+	std::vector<long> order;
+	for (int trial = 0; trial < trials; trial++) {
+		// the two halves of t.load, timed apart
+		double t1 = benchSeconds();
+		if (!t.loadLeaves(p.x.data(), p.size(), radius, order)) exit(1); // it says why
+		double t2 = benchSeconds();
+		t.computeNodes();
+		double t3 = benchSeconds();
+		findNeighborLists(t, (BallKey)1, t.node + t.firstLeaf, p.size(), lists);
+		long neighbors = lists.indices.size();
+		double t4 = benchSeconds();
+		r.build.add(t2 - t1);
+		r.upward.add(t3 - t2);
+		r.walk.add(t4 - t3);
+		r.interactions = (double)neighbors/p.size();
+		r.checksum = neighbors;
+	}
+	return r;
+}
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <cmath>
+#include <iostream>
+#include "paratreet.h"
+#include "benchmark.h"
+
+// barnes1d and barnes3d both name their classes Barnes*, so this one gets a namespace
+namespace barnes1d {
+#include "../barnes1d/cpu_code/barnes1d_cputree.h"
+}
+using namespace barnes1d;
+
+/*
+1D Barnes-Hut: the sorted x coordinates go into the leaves, the upward pass
+computes masses and centers of mass, and every particle walks the tree from
+the root.  The consumer doesn't count interactions.
+*/
+BenchResult benchBarnes1d(const BenchParticles &p, int trials) {
+	BenchResult r;
+	r.tree = "barnes1d";
+	r.particles = p.size();
+	r.depth = benchDepth1d(p.size());
+	BarnesParaTree t(r.depth);
+	for (int trial = 0; trial < trials; trial++) {
+		double t1 = benchSeconds();
+		buildLeaves1d(p, t.node + t.firstLeaf, t.size - t.firstLeaf);
+		double t2 = benchSeconds();
+		upwardPass1d(t.node, t.firstLeaf, true);
+		double t3 = benchSeconds();
+		double checksum = 0.0;
+		for (int k = t.firstLeaf; k < t.size; k++) {
+			if (t.node[k].mass == 0.0f) continue;
+			BarnesConsumer<BarnesParaTree, BarnesKey> c(t, t.node[k]);
+			t.requestKey(1, c);
+			checksum += c.acc;
+		}
+		double t4 = benchSeconds();
+		r.build.add(t2 - t1);
+		r.upward.add(t3 - t2);
+		r.walk.add(t4 - t3);
+		r.interactions = -1;
+		r.checksum = checksum;
+	}
+	return r;
+}
@@ -0,0 +1,45 @@
+#include "../barnes3d/cpu_code/barnes3d_cputree.h"
+#include "benchmark.h"
+
+/*
+3D Barnes-Hut: the particles go into the leaves in Morton order, the upward
+pass computes the moments, and every particle walks the tree from the root.
+*/
+BenchResult benchBarnes3d(const BenchParticles &p, int trials) {
+	BenchResult r;
+	r.tree = "barnes3d";
+	r.particles = p.size();
+	r.depth = getDepthFor(p.size());
+	BarnesParaTree t(r.depth);
+	int nLeaves = t.size - t.firstLeaf;
+	for (int trial = 0; trial < trials; trial++) {
+		double t1 = benchSeconds();
+		BarnesLeafSink sink(t.tree + t.firstLeaf, NULL, 0);
+		float vel[3] = {0.0f, 0.0f, 0.0f};
+		for (long i = 0; i < p.size(); i++) {
+			float pos[3] = {p.x[i], p.y[i], p.z[i]};
+			sink.particle(i, p.mass[i], pos, vel);
+		}
+		sortLeavesMorton(t.tree + t.firstLeaf, NULL, sink.filled);
+		sink.pad(nLeaves, vector3d(0.0, 0.0, 0.0));
+		double t2 = benchSeconds();
+		t.computeMoments(1);
+		double t3 = benchSeconds();
+		long interactions = 0;
+		double checksum = 0.0;
+		for (BarnesKey k = t.firstLeaf; k < (BarnesKey)t.size; k++) {
+			if (t.tree[k].mass == 0.0f) continue;
+			BarnesConsumer<BarnesParaTree, BarnesKey> c(t, t.tree[k]);
+			t.requestKey(1, c);
+			interactions += c.interactions;
+			checksum += c.phi;
+		}
+		double t4 = benchSeconds();
+		r.build.add(t2 - t1);
+		r.upward.add(t3 - t2);
+		r.walk.add(t4 - t3);
+		r.interactions = (double)interactions/p.size();
+		r.checksum = checksum;
+	}
+	return r;
+}
@@ -0,0 +1,38 @@
+#include "../fmm1d/cpu_code/FMM1d_cputree.h"
+#include "benchmark.h"
+
+/*
+1D FMM: the sorted x coordinates go into the leaves with empty local
+expansions, the upward pass computes masses and centers of mass, and every
+leaf walks the tree from the root as a sink.  The consumer doesn't count
+interactions.
+*/
+BenchResult benchFMM1d(const BenchParticles &p, int trials) {
+	BenchResult r;
+	r.tree = "fmm1d";
+	r.particles = p.size();
+	r.depth = benchDepth1d(p.size());
+	FMMParaTree t(r.depth);
+	for (int trial = 0; trial < trials; trial++) {
+		double t1 = benchSeconds();
+		buildLeaves1d(p, t.node + t.firstLeaf, t.size - t.firstLeaf);
+		for (int k = 1; k < t.size; k++) t.node[k].local = 0.0f;
+		double t2 = benchSeconds();
+		upwardPass1d(t.node, t.firstLeaf, true);
+		double t3 = benchSeconds();
+		double checksum = 0.0;
+		for (int k = t.firstLeaf; k < t.size; k++) {
+			if (t.node[k].mass == 0.0f) continue;
+			FMMConsumer<FMMParaTree, FMMKey> c(t, t.node[k]);
+			t.requestKey(1, c);
+			checksum += c.acc + t.node[k].local;
+		}
+		double t4 = benchSeconds();
+		r.build.add(t2 - t1);
+		r.upward.add(t3 - t2);
+		r.walk.add(t4 - t3);
+		r.interactions = -1;
+		r.checksum = checksum;
+	}
+	return r;
+}
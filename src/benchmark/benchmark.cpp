@@ -0,0 +1,78 @@
+#include "benchmark.h"
+#include <stdlib.h>
+#include <string.h>
+
+/// Write one phase's times, in seconds
+static void writePhase(FILE *out, const char *name, const BenchPhase &p) {
+	fprintf(out, "      \"%s\": {\"min\": %.9g, \"median\": %.9g, \"mean\": %.9g, \"max\": %.9g}", name,
+			p.min(), p.median(), p.mean(), p.max());
+}
+
+/*
+Benchmarks every CPU example tree on uniform, Plummer and clustered particles,
+timing the build, upward pass and walk separately over repeated trials.
+Writes the results as JSON, so runs can be compared between versions.
+*/
+int main(int argc, char *argv[]){
+
+	// Number of particles
+	long particles = 32768;
+	if (argc >= 2) {
+		particles = atol(argv[1]);
+	}
+	// Trials of each tree on each input
+	int trials = 5;
+	if (argc >= 3) {
+		trials = atoi(argv[2]);
+	}
+	// Seed of the initial conditions
+	unsigned long seed = 1;
+	if (argc >= 4) {
+		seed = strtoul(argv[3], NULL, 10);
+	}
+	// JSON file to write (standard output by default)
+	FILE *out = stdout;
+	if (argc >= 5) {
+		out = fopen(argv[4], "w");
+		if (!out) {
+			printf("Could not write %s\n", argv[4]);
+			return 1;
+		}
+	}
+	if (particles < 1 || trials < 1) {
+		printf("Usage: %s [particles] [trials] [seed] [output.json]\n", argv[0]);
+		return 1;
+	}
+
+	BenchResult (*trees[])(const BenchParticles &, int) = {benchBarnes1d, benchBarnes3d, benchBall1d, benchFMM1d};
+	std::vector<BenchResult> results;
+	for (int input = BENCH_UNIFORM; input <= BENCH_CLUSTERED; input++) {
+		BenchParticles p;
+		double t1 = benchSeconds();
+		makeParticles((BenchInput)input, p, particles, seed);
+		fprintf(stderr, "%s: %ld particles in %.3f s\n", benchInputName((BenchInput)input), particles, benchSeconds() - t1);
+		for (int i = 0; i < sizeof(trees)/sizeof(trees[0]); i++) {
+			results.push_back(trees[i](p, trials));
+			results.back().input = (BenchInput)input;
+			fprintf(stderr, "  %s: walk %.4f s (median)\n", results.back().tree.c_str(), results.back().walk.median());
+		}
+	}
+
+	fprintf(out, "{\n  \"particles\": %ld,\n  \"trials\": %d,\n  \"seed\": %lu,\n  \"results\": [\n", particles, trials, seed);
+	for (size_t i = 0; i < results.size(); i++) {
+		const BenchResult &r = results[i];
+		fprintf(out, "    {\n      \"tree\": \"%s\",\n      \"input\": \"%s\",\n      \"particles\": %ld,\n      \"depth\": %d,\n",
+				r.tree.c_str(), benchInputName(r.input), r.particles, r.depth);
+		if (r.interactions >= 0) fprintf(out, "      \"interactions_per_particle\": %.9g,\n", r.interactions);
+		else fprintf(out, "      \"interactions_per_particle\": null,\n");
+		fprintf(out, "      \"checksum\": %.17g,\n", r.checksum);
+		writePhase(out, "build", r.build);
+		fprintf(out, ",\n");
+		writePhase(out, "upward", r.upward);
+		fprintf(out, ",\n");
+		writePhase(out, "walk", r.walk);
+		fprintf(out, "\n    }%s\n", (i + 1 < results.size()) ? "," : "");
+	}
+	fprintf(out, "  ]\n}\n");
+	if (out != stdout) fclose(out);
+}
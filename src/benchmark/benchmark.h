@@ -0,0 +1,245 @@
+/* Benchmarks of the CPU example trees
+	 Initial conditions, timing and JSON output
+*/
+
+#ifndef __PARATREET_BENCHMARK
+#define __PARATREET_BENCHMARK
+
+#include <stdio.h>
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// Initial conditions the trees are benchmarked on
+enum BenchInput { BENCH_UNIFORM = 0, BENCH_PLUMMER = 1, BENCH_CLUSTERED = 2 };
+
+/// Name of an initial condition, as reported
+inline const char *benchInputName(BenchInput input) {
+	static const char *names[] = {"uniform", "plummer", "clustered"};
+	return names[input];
+}
+
+/**
+ Deterministic random numbers (splitmix64), so every machine and compiler
+ benchmarks the same particles for the same seed.  The standard library
+ distributions are implementation defined, so they aren't used.
+*/
+class BenchRandom {
+	uint64_t state;
+	public:
+	BenchRandom(uint64_t seed) : state(seed) {}
+
+	uint64_t next() {
+		uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+		return z ^ (z >> 31);
+	}
+
+	/// Uniform in [0,1)
+	double uniform() { return (next() >> 11)*(1.0/9007199254740992.0); }
+
+	/// Standard normal, by Box-Muller
+	double gaussian() {
+		double u = 1.0 - uniform(), v = uniform();
+		return sqrt(-2.0*log(u))*cos(2.0*M_PI*v);
+	}
+};
+
+/// Particles as SoA arrays, all inside the box [0,BOX)^3 of the examples
+struct BenchParticles {
+	static constexpr double BOX = 100.0;
+	std::vector<float> mass, x, y, z;
+
+	void resize(long n) { mass.resize(n); x.resize(n); y.resize(n); z.resize(n); }
+	long size() const { return mass.size(); }
+	void set(long i, double px, double py, double pz) {
+		mass[i] = 1.0f/mass.size();
+		x[i] = px; y[i] = py; z[i] = pz;
+	}
+};
+
+/// Particles uniformly distributed in the box
+inline void makeUniform(BenchParticles &p, long n, BenchRandom &r) {
+	p.resize(n);
+	for (long i = 0; i < n; i++) {
+		double px = r.uniform(), py = r.uniform(), pz = r.uniform();
+		p.set(i, px*p.BOX, py*p.BOX, pz*p.BOX);
+	}
+}
+
+/**
+ A Plummer sphere of scale radius BOX/20 in the middle of the box, sampled
+ from its cumulative mass profile (Aarseth, Henon & Wielen 1974); the few
+ particles beyond the box are drawn again.
+*/
+inline void makePlummer(BenchParticles &p, long n, BenchRandom &r) {
+	const double a = p.BOX/20, center = p.BOX/2;
+	p.resize(n);
+	for (long i = 0; i < n; i++) {
+		double radius;
+		do {
+			double m = r.uniform();
+			radius = (m > 0.0) ? a/sqrt(pow(m, -2.0/3.0) - 1.0) : 0.0;
+		} while (!(radius < center));
+		double cosTheta = 2.0*r.uniform() - 1.0, phi = 2.0*M_PI*r.uniform();
+		double sinTheta = sqrt(1.0 - cosTheta*cosTheta);
+		p.set(i, center + radius*sinTheta*cos(phi), center + radius*sinTheta*sin(phi), center + radius*cosTheta);
+	}
+}
+
+/**
+ Clustered particles in the Zel'dovich approximation: a lattice displaced
+ along the gradient of a random potential, a sum of plane waves with a
+ power-law spectrum, far enough that shells cross into sheets, filaments and
+ knots.  Positions wrap around the periodic box.
+*/
+inline void makeClustered(BenchParticles &p, long n, BenchRandom &r) {
+	const int MODES = 64, KMAX = 8; // wavevectors up to KMAX*2pi/BOX on each axis
+	const double SPECTRAL_INDEX = -2.0, GROWTH = 2.0;
+	double kx[MODES], ky[MODES], kz[MODES], amp[MODES], phase[MODES];
+	double norm = 0.0;
+	for (int m = 0; m < MODES; m++) {
+		int ix, iy, iz;
+		do {
+			ix = (int)(r.uniform()*(2*KMAX + 1)) - KMAX;
+			iy = (int)(r.uniform()*(2*KMAX + 1)) - KMAX;
+			iz = (int)(r.uniform()*(2*KMAX + 1)) - KMAX;
+		} while (ix == 0 && iy == 0 && iz == 0);
+		double k = sqrt((double)(ix*ix + iy*iy + iz*iz));
+		kx[m] = 2.0*M_PI*ix/p.BOX; ky[m] = 2.0*M_PI*iy/p.BOX; kz[m] = 2.0*M_PI*iz/p.BOX;
+		// displacement amplitude |k| phi_k, with the power spectrum P(k) ~ k^n
+		amp[m] = pow(k, SPECTRAL_INDEX/2)*fabs(r.gaussian());
+		phase[m] = 2.0*M_PI*r.uniform();
+		norm += amp[m]*amp[m]*k*k/2;
+	}
+	// Scale so the rms compression along the waves is GROWTH: where it passes 1 the flow has crossed shells
+	norm = sqrt(norm)*2.0*M_PI/p.BOX;
+	for (int m = 0; m < MODES; m++) amp[m] *= GROWTH/norm;
+
+	long side = (long)ceil(cbrt((double)n));
+	double spacing = p.BOX/side;
+	p.resize(n);
+	for (long i = 0; i < n; i++) {
+		double q[3] = {(i%side + 0.5)*spacing, (i/side%side + 0.5)*spacing, (i/(side*side) + 0.5)*spacing};
+		double d[3] = {0.0, 0.0, 0.0};
+		for (int m = 0; m < MODES; m++) {
+			double kn = sqrt(kx[m]*kx[m] + ky[m]*ky[m] + kz[m]*kz[m]);
+			double s = amp[m]*sin(kx[m]*q[0] + ky[m]*q[1] + kz[m]*q[2] + phase[m])/kn;
+			d[0] += s*kx[m]; d[1] += s*ky[m]; d[2] += s*kz[m];
+		}
+		for (int a = 0; a < 3; a++) {
+			q[a] = fmod(q[a] + d[a], p.BOX);
+			if (q[a] < 0.0) q[a] += p.BOX;
+		}
+		p.set(i, q[0], q[1], q[2]);
+	}
+}
+
+inline void makeParticles(BenchInput input, BenchParticles &p, long n, uint64_t seed) {
+	BenchRandom r(seed);
+	if (input == BENCH_UNIFORM) makeUniform(p, n, r);
+	else if (input == BENCH_PLUMMER) makePlummer(p, n, r);
+	else makeClustered(p, n, r);
+}
+
+/// Seconds since some fixed time
+inline double benchSeconds() {
+	return std::chrono::duration<double>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+}
+
+/// Times of one phase over the trials
+struct BenchPhase {
+	std::vector<double> seconds;
+
+	void add(double s) { seconds.push_back(s); }
+	double min() const { return *std::min_element(seconds.begin(), seconds.end()); }
+	double max() const { return *std::max_element(seconds.begin(), seconds.end()); }
+	double mean() const {
+		double sum = 0.0;
+		for (size_t i = 0; i < seconds.size(); i++) sum += seconds[i];
+		return sum/seconds.size();
+	}
+	double median() const {
+		std::vector<double> s(seconds);
+		std::sort(s.begin(), s.end());
+		return (s.size()%2) ? s[s.size()/2] : (s[s.size()/2 - 1] + s[s.size()/2])/2;
+	}
+};
+
+/**
+ Result of benchmarking one tree on one input.  The build phase turns the
+ particles into the leaves of the tree, the upward pass computes the nodes
+ above them, and the walk runs the example's consumer for every particle.
+*/
+struct BenchResult {
+	std::string tree;
+	BenchInput input;
+	long particles;
+	int depth;
+	BenchPhase build, upward, walk;
+	double interactions; // per particle, of the last walk
+	double checksum;     // sum of the walk results, to tell if they changed
+};
+
+/**
+ Benchmarks of each example tree, in their own files since the examples
+ reuse class names.  Each runs the given number of trials on the particles.
+*/
+BenchResult benchBarnes1d(const BenchParticles &p, int trials);
+BenchResult benchBarnes3d(const BenchParticles &p, int trials);
+BenchResult benchBall1d(const BenchParticles &p, int trials);
+BenchResult benchFMM1d(const BenchParticles &p, int trials);
+
+/// Depth of a balanced binary tree with a leaf for each of n particles
+inline int benchDepth1d(long n) {
+	int depth = 0;
+	while ((1L << depth) < n) depth++;
+	return depth;
+}
+
+/**
+ The 1D examples see the particles' x coordinates: sorted, they fill the
+ leaves of a balanced binary tree, and the leaves after them are massless
+ copies of the last particle.  Each leaf's cell reaches halfway to its
+ neighbours, so the cells of a subtree tile its range.
+*/
+template <class NodeData>
+void buildLeaves1d(const BenchParticles &p, NodeData *leaves, int nLeaves) {
+	long n = p.size();
+	std::vector<std::pair<float, float> > order(n); // x and mass
+	for (long i = 0; i < n; i++) order[i] = std::make_pair(p.x[i], p.mass[i]);
+	std::sort(order.begin(), order.end());
+	for (int i = 0; i < nLeaves; i++) {
+		long j = std::min((long)i, n - 1);
+		float x = order[j].first;
+		leaves[i].mass = (i < n) ? order[i].second : 0.0f;
+		leaves[i].x = x;
+		leaves[i].xMin = (j > 0) ? (order[j - 1].first + x)/2 : x;
+		leaves[i].xMax = (j + 1 < n) ? (x + order[j + 1].first)/2 : x;
+	}
+}
+
+/**
+ Upward pass of a 1D tree: each node holds the mass of its subtree and spans
+ its children's cells.  Its x is the center of mass for gravity, or where
+ its children's cells meet for ball searches.
+*/
+template <class NodeData>
+void upwardPass1d(NodeData *node, int firstLeaf, bool centerOfMass) {
+	for (int i = firstLeaf - 1; i >= 1; i--) {
+		const NodeData &l = node[2*i], &r = node[2*i + 1];
+		node[i].mass = l.mass + r.mass;
+		if (!centerOfMass) node[i].x = l.xMax;
+		else if (node[i].mass > 0.0f) node[i].x = (l.mass*l.x + r.mass*r.x)/node[i].mass;
+		else node[i].x = (l.xMin + r.xMax)/2;
+		node[i].xMin = l.xMin;
+		node[i].xMax = r.xMax;
+	}
+}
+
+#endif
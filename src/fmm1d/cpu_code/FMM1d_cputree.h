@@ -37,6 +37,8 @@ class FMMParaTree{
 	//Process node requests and send back nodes/leaves
 	template <class Consumer>
 	void requestKey(FMMKey bk, Consumer &c){
+		PARATREET_STACK_DEPTH;
+		PARATREET_COUNT(STAT_WALKS, bk == 1);
 		if(bk<1 || bk>= size) printf("BarnesParaTree: Requested INVALID tree node %d\n", (int)bk);
 		else{
 			if(bk>=firstLeaf)
@@ -112,22 +112,27 @@ public:
 	
 	/// Consume a tree node: recursively opens the node if nearby, or lumps it if distant.
 	inline CUDA_BOTH void consumeNode(const FMMNodeData &n,const FMMKey &key) { 
+            PARATREET_COUNT(STAT_NODES_VISITED, 1);
             float openingThreshold=0.8;
             float radius=(n.xMax-n.xMin)/openingThreshold;
             float myRadius = 1.5*(me.xMax - me.xMin)/openingThreshold;
             float distance=fabs(me.x-n.x);
             if(distance > radius + myRadius) { // local expansion is
                                                // valid
+                PARATREET_COUNT(STAT_NODE_INTERACTIONS, 1);
                 addFarToLocal(n);
                 }
             else if(radius > myRadius) {  // open recursively
+                PARATREET_COUNT(STAT_NODES_OPENED, 1);
                 tree.requestChildren(key,*this);
             }
             else if(tree.isLeaf(me)) {
                 if(distance > radius) {
+                    PARATREET_COUNT(STAT_NODE_INTERACTIONS, 1);
                     addGravityFar(n);
                 }
                 else {
+                    PARATREET_COUNT(STAT_NODES_OPENED, 1);
                     tree.requestChildren(key,*this);
                 }
             }
@@ -143,6 +148,8 @@ public:
             float openingThreshold=0.8;
             float myRadius = 1.5*(me.xMax - me.xMin)/openingThreshold;
             float distance=fabs(me.x-l.x);
+            PARATREET_COUNT(STAT_NODES_VISITED, 1);
+            PARATREET_COUNT(STAT_LEAF_INTERACTIONS, 1);
             if(distance > myRadius) {
                 addFarToLocal(l);
             }
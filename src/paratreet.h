@@ -20,6 +20,9 @@
 #define TRACE_STACK(print) /* print */
 #define TRACE_BARNES(print) /* print */
 
+/** Traversal counters, when compiled with -DPARATREET_STATS */
+#include "paratreet_stats.h"
+
 
 /** Set this to 1 to enable runtime checking */
 #define SANITY_CHECKS 1
@@ -59,6 +62,19 @@ public:
 	inline void consumeLeaf(LeafData &l,const Key &key) { /* do leaf physics here */ }
 };
 
+/**
+ How a distributed ParaTree continues a consumer's walk into a remote subtree:
+ fetch the remote nodes to the consumer, or ship the consumer to the piece
+ owning the subtree, which walks it locally and sends back the partial result.
+ Specialize RemotePolicy to pick the policy for a consumer type.
+*/
+enum RemoteWalk { FETCH_DATA = 0, SHIP_CONSUMER = 1 };
+
+template <class Consumer>
+struct RemotePolicy {
+	enum { walk = FETCH_DATA };
+};
+
 };
 
 
@@ -0,0 +1,123 @@
+/**
+ Shared node cache for ParaTreeT: the parallel tree toolkit.
+
+ A fixed-size, open-addressed hash table of tree nodes, meant to be
+ shared by all the threads of a process.  Lookups never lock, and the
+ first thread to fill a key writes it; readers only see a slot once
+ its data is complete.  A key can be claimed before its data arrives,
+ so other threads know a fetch is already on the way.
+*/
+#ifndef __PARATREET_CACHE_HEADER
+#define __PARATREET_CACHE_HEADER
+
+#include <cstddef>
+#include <atomic>
+#include <vector>
+
+namespace ParaTreeT {
+
+template <class Key, class Data>
+class NodeCache {
+	/// Slot states: claimed (data on the way), being written, and ready to read
+	enum { CLAIMED = 0, WRITING = 1, READY = 2 };
+
+	/// One cached node.  key==emptyKey marks a free slot.
+	struct Slot {
+		std::atomic<Key> key;
+		std::atomic<int> state;
+		Data data;
+	};
+	std::vector<Slot> slots;
+	size_t mask; // capacity-1; the capacity is a power of two
+	Key emptyKey;
+
+	inline size_t hash(const Key &k) const {
+		return (size_t)(k * 0x9E3779B97F4A7C15ull) >> 7;
+	}
+
+public:
+	/// Make a cache with room for at least this many nodes.  emptyKey must never be inserted.
+	NodeCache(size_t minCapacity = 1024, Key emptyKey = 0) : emptyKey(emptyKey) {
+		size_t capacity = 1;
+		while (capacity < minCapacity) capacity *= 2;
+		std::vector<Slot> s(capacity);
+		slots.swap(s);
+		mask = capacity - 1;
+		clear();
+	}
+
+	size_t capacity() const { return slots.size(); }
+
+	/// Drop every cached node.  Not thread safe: call between walks.
+	void clear() {
+		for (size_t i = 0; i < slots.size(); i++) {
+			slots[i].key.store(emptyKey, std::memory_order_relaxed);
+			slots[i].state.store(CLAIMED, std::memory_order_relaxed);
+		}
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	/// Return the cached data for this key, or NULL if it isn't (completely) cached yet
+	const Data *lookup(const Key &k) const {
+		Slot *s = find(k);
+		return (s && s->state.load(std::memory_order_acquire) == READY) ? &s->data : NULL;
+	}
+
+	/**
+	 Claim this key for a fetch.  Returns true if the caller is the first to ask,
+	 false if the key is already claimed or cached, or the cache is full.
+	*/
+	bool claim(const Key &k) {
+		bool claimed;
+		slotFor(k, claimed);
+		return claimed;
+	}
+
+	/**
+	 Insert this data for this key.  If another thread already filled the key,
+	 its copy wins.  Returns false if the cache is full.
+	*/
+	bool insert(const Key &k, const Data &d) {
+		bool claimed;
+		Slot *s = slotFor(k, claimed);
+		if (!s) return false;
+		int expected = CLAIMED;
+		if (s->state.compare_exchange_strong(expected, WRITING, std::memory_order_acq_rel)) {
+			s->data = d;
+			s->state.store(READY, std::memory_order_release);
+		}
+		return true;
+	}
+
+private:
+	/// Find the slot holding this key, or NULL
+	Slot *find(const Key &k) const {
+		for (size_t i = hash(k) & mask, probes = 0; probes <= mask; i = (i + 1) & mask, probes++) {
+			Key found = slots[i].key.load(std::memory_order_acquire);
+			if (found == k)
+				return const_cast<Slot *>(&slots[i]);
+			if (found == emptyKey)
+				return NULL;
+		}
+		return NULL;
+	}
+
+	/// Find or claim the slot for this key; claimed tells whether we took a free slot
+	Slot *slotFor(const Key &k, bool &claimed) {
+		claimed = false;
+		for (size_t i = hash(k) & mask, probes = 0; probes <= mask; i = (i + 1) & mask, probes++) {
+			Key expected = emptyKey;
+			if (slots[i].key.compare_exchange_strong(expected, k, std::memory_order_acq_rel)) {
+				claimed = true;
+				return &slots[i];
+			}
+			if (expected == k)
+				return &slots[i];
+		}
+		return NULL;
+	}
+};
+
+};
+
+#endif
@@ -0,0 +1,83 @@
+/**
+ Result output for ParaTreeT: the parallel tree toolkit.
+
+ Each piece packs its results (accelerations, potentials, neighbor
+ lists...) into a binary ResultBuffer.  The buffers then go to a single
+ file, one after another in piece order: the sizes are gathered, turned
+ into offsets by an exclusive prefix sum, and every piece writes its
+ buffer at its own offset, independently of the others.
+*/
+#ifndef __PARATREET_OUTPUT_HEADER
+#define __PARATREET_OUTPUT_HEADER
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+
+namespace ParaTreeT {
+
+/// Results of one piece, in the order they were put.  Only put plain data.
+class ResultBuffer {
+	std::vector<char> bytes;
+public:
+	template <class T>
+	void put(const T &v) { put(&v, 1); }
+
+	template <class T>
+	void put(const T *v, size_t n) {
+		const char *p = (const char *)v;
+		bytes.insert(bytes.end(), p, p + n*sizeof(T));
+	}
+
+	size_t size() const { return bytes.size(); }
+	const char *data() const { return bytes.data(); }
+	void clear() { bytes.clear(); }
+};
+
+/// Exclusive prefix sum of the piece sizes: where each piece's results start; the last entry is the total
+inline std::vector<long> resultOffsets(const std::vector<long> &sizes) {
+	std::vector<long> offsets(sizes.size() + 1, 0);
+	for (size_t i = 0; i < sizes.size(); i++)
+		offsets[i + 1] = offsets[i] + sizes[i];
+	return offsets;
+}
+
+/// Create (or truncate) a result file of this many bytes, for the pieces to write into
+inline bool createResultFile(const char *path, long bytes) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("ParaTreeT: can't create result file %s\n", path);
+		return false;
+	}
+	bool ok = ftruncate(fd, bytes) == 0;
+	return (close(fd) == 0) && ok;
+}
+
+/// Write a piece's results at its offset in a result file made by createResultFile
+inline bool writeResults(const char *path, long offset, const ResultBuffer &r) {
+	int fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		printf("ParaTreeT: can't open result file %s\n", path);
+		return false;
+	}
+	const char *p = r.data();
+	size_t left = r.size();
+	while (left > 0) {
+		ssize_t wrote = pwrite(fd, p, left, offset);
+		if (wrote <= 0) break;
+		p += wrote; left -= wrote; offset += wrote;
+	}
+	if (left > 0)
+		printf("ParaTreeT: short write to result file %s\n", path);
+	return (close(fd) == 0) && left == 0;
+}
+
+/// Write one buffer as the whole result file (for single-process drivers)
+inline bool writeResultFile(const char *path, const ResultBuffer &r) {
+	return createResultFile(path, r.size()) && writeResults(path, 0, r);
+}
+
+};
+
+#endif
@@ -0,0 +1,219 @@
+/**
+ Particle snapshot reader for ParaTreeT: the parallel tree toolkit.
+
+ Reads N-body snapshots straight out of a read-only file mapping, so a
+ process only touches the pages of the particles it asks for.  Two
+ formats are understood:
+   - Tipsy: a 28 or 32 byte header, then gas, dark and star particle
+     records, in either byte order (standard Tipsy files are big-endian).
+   - Raw SoA: a SnapshotSoAHeader, then the columns mass, x, y, z, vx,
+     vy and vz of count floats each, in the byte order of its marker.
+ Particles are handed to a sink one at a time, so the caller can write
+ them directly into its tree.
+*/
+#ifndef __PARATREET_SNAPSHOT_HEADER
+#define __PARATREET_SNAPSHOT_HEADER
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ParaTreeT {
+
+enum SnapshotFormat { SNAPSHOT_UNKNOWN = 0, SNAPSHOT_TIPSY = 1, SNAPSHOT_SOA = 2 };
+
+/// Header of a raw SoA snapshot
+struct SnapshotSoAHeader {
+	char magic[8];       // "PTSOA"
+	uint32_t byteOrder;  // 0x01020304 as written by the machine that wrote the file
+	uint32_t columns;    // 7: mass, x, y, z, vx, vy, vz
+	int64_t count;       // number of particles
+	int64_t pad;
+};
+
+/// Byte order marker of SnapshotSoAHeader
+static const uint32_t snapshotByteOrder = 0x01020304;
+
+/// Reverse the bytes of n 32-bit words in place.  A plain loop, so the compiler vectorizes it.
+inline void swapWords(uint32_t *w, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		w[i] = __builtin_bswap32(w[i]);
+}
+
+class SnapshotReader {
+	/// Tipsy record sizes, in floats
+	enum { GAS_FLOATS = 12, DARK_FLOATS = 9, STAR_FLOATS = 11 };
+	/// Particles converted at a time when reading SoA columns
+	enum { BLOCK = 1024 };
+
+	const char *base;
+	size_t bytes;
+	bool swapped;
+	// Tipsy: particles of each kind, and where their records start
+	long long nGas, nDark, nStar;
+	size_t gasOffset, darkOffset, starOffset;
+	// SoA: where the columns start
+	size_t columnOffset;
+
+public:
+	SnapshotFormat format;
+	long long count;
+	double time; // Tipsy simulation time
+
+	/// Map a snapshot; format is SNAPSHOT_UNKNOWN if the file can't be read
+	SnapshotReader(const char *path) : base(NULL), bytes(0), swapped(false), format(SNAPSHOT_UNKNOWN), count(0), time(0.0) {
+		int fd = open(path, O_RDONLY);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < 28) {
+			printf("SnapshotReader: can't read %s\n", path);
+			if (fd >= 0) close(fd);
+			return;
+		}
+		bytes = st.st_size;
+		void *m = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd); // the mapping stays valid
+		if (m == MAP_FAILED) {
+			printf("SnapshotReader: can't map %s\n", path);
+			bytes = 0;
+			return;
+		}
+		base = (const char *)m;
+		if (!openSoA() && !openTipsy())
+			printf("SnapshotReader: %s is neither a Tipsy nor a SoA snapshot\n", path);
+	}
+
+	~SnapshotReader() {
+		if (base) munmap((void *)base, bytes);
+	}
+
+	bool ok() const { return format != SNAPSHOT_UNKNOWN; }
+
+	/**
+	 Read particles first to first+n-1, calling
+	   sink.particle(index, mass, pos, vel)
+	 for each, with pos and vel pointing to 3 floats.
+	*/
+	template <class Sink>
+	void read(long long first, long long n, Sink &sink) {
+		if (first < 0) first = 0;
+		if (first + n > count) n = count - first;
+		if (n <= 0) return;
+		if (format == SNAPSHOT_SOA) {
+			for (int c = 0; c < 7; c++)
+				adviseSequential(columnOffset + ((size_t)c*count + first)*4, n*4);
+		}
+		else // the leading mass, pos and vel words of each record
+			adviseSequential(recordOffset(first), recordOffset(first + n - 1) + 7*4 - recordOffset(first));
+		if (format == SNAPSHOT_SOA)
+			readSoA(first, n, sink);
+		else
+			readTipsy(first, n, sink);
+	}
+
+private:
+	uint32_t word(size_t offset) const {
+		uint32_t w;
+		memcpy(&w, base + offset, 4);
+		return swapped ? __builtin_bswap32(w) : w;
+	}
+
+	/// Tell the kernel the length bytes at offset (from base) will be read in order
+	void adviseSequential(size_t offset, size_t length) const {
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t start = offset/page*page; // madvise wants a page-aligned start
+		if (madvise((void *)(base + start), offset + length - start, MADV_SEQUENTIAL) != 0)
+			printf("SnapshotReader: madvise failed: %s\n", strerror(errno));
+	}
+
+	/// Byte offset of a particle's data (its mass, for SoA)
+	size_t recordOffset(long long i) const {
+		if (format == SNAPSHOT_SOA) return columnOffset + i*4;
+		if (i < nGas) return gasOffset + i*GAS_FLOATS*4;
+		i -= nGas;
+		if (i < nDark) return darkOffset + i*DARK_FLOATS*4;
+		return starOffset + (i - nDark)*STAR_FLOATS*4;
+	}
+
+	bool openSoA() {
+		SnapshotSoAHeader h;
+		if (bytes < sizeof(h)) return false;
+		memcpy(&h, base, sizeof(h));
+		if (strncmp(h.magic, "PTSOA", 8) != 0) return false;
+		swapped = (h.byteOrder != snapshotByteOrder);
+		if (swapped && h.byteOrder != __builtin_bswap32(snapshotByteOrder)) return false;
+		if (swapped) {
+			h.columns = __builtin_bswap32(h.columns);
+			h.count = (int64_t)__builtin_bswap64((uint64_t)h.count);
+		}
+		if (h.columns != 7 || h.count < 0 || sizeof(h) + 7*4*(size_t)h.count > bytes) return false;
+		count = h.count;
+		columnOffset = sizeof(h);
+		format = SNAPSHOT_SOA;
+		return true;
+	}
+
+	bool openTipsy() {
+		// header: double time, then nbodies, ndim, nsph, ndark, nstar, and maybe a pad word
+		for (int s = 0; s < 2; s++) {
+			swapped = (s == 1);
+			if (word(12) != 3) continue; // ndim
+			nGas = word(16);
+			nDark = word(20);
+			nStar = word(24);
+			if (nGas + nDark + nStar != (long long)word(8)) continue;
+			size_t records = (nGas*GAS_FLOATS + nDark*DARK_FLOATS + nStar*STAR_FLOATS)*4;
+			size_t header = (bytes == 32 + records) ? 32 : 28;
+			if (bytes < header + records) continue;
+			uint64_t t;
+			memcpy(&t, base, 8);
+			if (swapped) t = __builtin_bswap64(t);
+			memcpy(&time, &t, 8);
+			gasOffset = header;
+			darkOffset = gasOffset + nGas*GAS_FLOATS*4;
+			starOffset = darkOffset + nDark*DARK_FLOATS*4;
+			count = nGas + nDark + nStar;
+			format = SNAPSHOT_TIPSY;
+			return true;
+		}
+		swapped = false;
+		return false;
+	}
+
+	/// Convert blocks of each column, then hand the particles over
+	template <class Sink>
+	void readSoA(long long first, long long n, Sink &sink) {
+		float block[7][BLOCK];
+		for (long long start = first; start < first + n; start += BLOCK) {
+			size_t m = (size_t)((first + n - start < BLOCK) ? first + n - start : (long long)BLOCK);
+			for (int c = 0; c < 7; c++) {
+				memcpy(block[c], base + columnOffset + ((size_t)c*count + start)*4, m*4);
+				if (swapped) swapWords((uint32_t *)block[c], m);
+			}
+			for (size_t i = 0; i < m; i++) {
+				float pos[3] = {block[1][i], block[2][i], block[3][i]};
+				float vel[3] = {block[4][i], block[5][i], block[6][i]};
+				sink.particle(start + i, block[0][i], pos, vel);
+			}
+		}
+	}
+
+	/// Convert each record's leading mass, pos and vel words, then hand the particle over
+	template <class Sink>
+	void readTipsy(long long first, long long n, Sink &sink) {
+		for (long long i = first; i < first + n; i++) {
+			float r[7];
+			memcpy(r, base + recordOffset(i), sizeof(r));
+			if (swapped) swapWords((uint32_t *)r, 7);
+			sink.particle(i, r[0], &r[1], &r[4]);
+		}
+	}
+};
+
+};
+
+#endif
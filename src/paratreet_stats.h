@@ -0,0 +1,222 @@
+/**
+ Traversal statistics for ParaTreeT: the parallel tree toolkit.
+
+ Consumers and tree backends count what a walk does: walks started,
+ nodes visited and opened, node and leaf interactions, remote requests,
+ cache hits and misses, bytes received, and the deepest stack of nested
+ requests.  Counters are kept per thread (so per PE under Charm++), and
+ summed once the walks are over.
+
+ Compile with -DPARATREET_STATS to count; otherwise the PARATREET_COUNT,
+ PARATREET_STACK_DEPTH and PARATREET_STAT macros compile to nothing.
+ Device code never counts.
+*/
+#ifndef __PARATREET_STATS_HEADER
+#define __PARATREET_STATS_HEADER
+
+#if defined(PARATREET_STATS) && !defined(__CUDA_ARCH__)
+
+#include <stdio.h>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+#ifdef __CHARMC__
+#include "charm++.h"
+#  define PARATREET_STATS_PRINT CkPrintf
+#else
+#  define PARATREET_STATS_PRINT printf
+#endif
+
+/// Add n to one of this thread's counters, e.g. PARATREET_COUNT(STAT_NODES_OPENED, 1)
+#  define PARATREET_COUNT(counter, n) (ParaTreeT::threadStats().count[ParaTreeT::counter] += (n))
+/// Count one more level of nested requests until the end of the enclosing scope
+#  define PARATREET_STACK_DEPTH ParaTreeT::StackDepthGuard paratreetStackDepth
+/// Statements that only run when counting, e.g. to print the counters
+#  define PARATREET_STAT(x) x
+
+namespace ParaTreeT {
+
+enum StatCounter {
+	STAT_WALKS = 0,            // walks started at the root, one per sink
+	STAT_NODES_VISITED,        // nodes and leaves handed to a consumer
+	STAT_NODES_OPENED,         // nodes whose children were requested
+	STAT_NODE_INTERACTIONS,    // nodes used whole, without opening them
+	STAT_LEAF_INTERACTIONS,    // leaves used
+	STAT_REMOTE_REQUESTS,      // requests (or batches) sent for data not in memory
+	STAT_CACHE_HITS,           // remote data found in a cache
+	STAT_CACHE_MISSES,         // remote data that had to be fetched
+	STAT_BYTES_RECEIVED,       // bytes of remote data received
+	NUM_STAT_COUNTERS
+};
+
+static const char *statCounterNames[NUM_STAT_COUNTERS] = {
+	"walks", "nodes visited", "nodes opened", "node interactions", "leaf interactions",
+	"remote requests", "cache hits", "cache misses", "bytes received"
+};
+
+/// One thread's counters, or the sum of several
+struct TraversalStats {
+	long long count[NUM_STAT_COUNTERS];
+	long long maxStackDepth;
+	int stackDepth; // nested requests right now
+
+	TraversalStats() { clear(); }
+
+	void clear() {
+		for (int i = 0; i < NUM_STAT_COUNTERS; i++) count[i] = 0;
+		maxStackDepth = 0;
+		stackDepth = 0;
+	}
+
+	void add(const TraversalStats &s) {
+		for (int i = 0; i < NUM_STAT_COUNTERS; i++) count[i] += s.count[i];
+		maxStackDepth = std::max(maxStackDepth, s.maxStackDepth);
+	}
+
+	/// Print the counters, and the interactions per walk
+	void print(const char *title) const {
+		PARATREET_STATS_PRINT("%s:\n", title);
+		for (int i = 0; i < NUM_STAT_COUNTERS; i++)
+			PARATREET_STATS_PRINT("  %-18s %lld\n", statCounterNames[i], count[i]);
+		PARATREET_STATS_PRINT("  %-18s %lld\n", "max stack depth", maxStackDepth);
+		if (count[STAT_WALKS] > 0)
+			PARATREET_STATS_PRINT("  per walk: %.1f nodes visited, %.1f node and %.1f leaf interactions\n",
+					(double)count[STAT_NODES_VISITED]/count[STAT_WALKS],
+					(double)count[STAT_NODE_INTERACTIONS]/count[STAT_WALKS],
+					(double)count[STAT_LEAF_INTERACTIONS]/count[STAT_WALKS]);
+	}
+};
+
+/// The counters of every thread, and those of threads that have exited
+class StatsRegistry {
+	std::mutex lock;
+	std::vector<TraversalStats *> live;
+	TraversalStats retired;
+public:
+	void enter(TraversalStats *s) {
+		std::lock_guard<std::mutex> g(lock);
+		live.push_back(s);
+	}
+	void leave(TraversalStats *s) {
+		std::lock_guard<std::mutex> g(lock);
+		retired.add(*s);
+		live.erase(std::find(live.begin(), live.end(), s));
+	}
+	TraversalStats total() {
+		std::lock_guard<std::mutex> g(lock);
+		TraversalStats sum = retired;
+		for (size_t i = 0; i < live.size(); i++) sum.add(*live[i]);
+		return sum;
+	}
+	void clear() {
+		std::lock_guard<std::mutex> g(lock);
+		retired.clear();
+		for (size_t i = 0; i < live.size(); i++) live[i]->clear();
+	}
+};
+
+inline StatsRegistry &statsRegistry() {
+	static StatsRegistry r;
+	return r;
+}
+
+/// Counters that join the registry while their thread runs
+struct ThreadStats : public TraversalStats {
+	ThreadStats() { statsRegistry().enter(this); }
+	~ThreadStats() { statsRegistry().leave(this); }
+};
+
+/// This thread's counters
+inline TraversalStats &threadStats() {
+	static thread_local ThreadStats s;
+	return s;
+}
+
+/// Sum of the counters of every thread.  Only exact while no walk is running.
+inline TraversalStats totalStats() {
+	return statsRegistry().total();
+}
+
+/// Zero the counters of every thread.  Call between walks.
+inline void clearStats() {
+	statsRegistry().clear();
+}
+
+/// This thread's counters, leaving them zero: what a PE contributes to a reduction
+inline TraversalStats takeThreadStats() {
+	TraversalStats s = threadStats();
+	threadStats().clear();
+	return s;
+}
+
+/// Counts one level of nested requests while in scope
+struct StackDepthGuard {
+	TraversalStats &s;
+	StackDepthGuard() : s(threadStats()) {
+		if (++s.stackDepth > s.maxStackDepth) s.maxStackDepth = s.stackDepth;
+	}
+	~StackDepthGuard() { s.stackDepth--; }
+};
+
+#ifdef __CHARMC__
+/**
+ This PE's counters, taken for a reduction as two tuple elements: the
+ counters to sum, and the stack depth to max.  Only the first chare of a PE
+ to contribute gets its counters, so every PE is counted once.
+*/
+struct StatsContribution {
+	double sums[NUM_STAT_COUNTERS];
+	double maxStackDepth;
+
+	StatsContribution() {
+		TraversalStats s = takeThreadStats();
+		for (int i = 0; i < NUM_STAT_COUNTERS; i++) sums[i] = (double)s.count[i];
+		maxStackDepth = (double)s.maxStackDepth;
+	}
+
+	CkReduction::tupleElement sumElement() {
+		return CkReduction::tupleElement(sizeof(sums), sums, CkReduction::sum_double);
+	}
+	CkReduction::tupleElement maxElement() {
+		return CkReduction::tupleElement(sizeof(double), &maxStackDepth, CkReduction::max_double);
+	}
+
+	/// Counters of every PE, from the reduced sumElement and maxElement
+	static TraversalStats reduced(const CkReduction::tupleElement &sum, const CkReduction::tupleElement &max) {
+		TraversalStats s;
+		for (int i = 0; i < NUM_STAT_COUNTERS; i++) s.count[i] = (long long)((double *)sum.data)[i];
+		s.maxStackDepth = (long long)*(double *)max.data;
+		return s;
+	}
+};
+
+/// Contribute this PE's counters from a chare, to a callback taking a CkReductionMsg
+template <class Chare>
+inline void contributeStats(Chare *chare, const CkCallback &cb) {
+	StatsContribution c;
+	CkReduction::tupleElement tuple[] = {c.sumElement(), c.maxElement()};
+	CkReductionMsg *msg = CkReductionMsg::buildFromTuple(tuple, 2);
+	msg->setCallback(cb);
+	chare->contribute(msg);
+}
+
+/// Counters of every PE, from a reduction of contributeStats
+inline TraversalStats reducedStats(CkReductionMsg *m) {
+	int n;
+	CkReduction::tupleElement *results;
+	m->toTuple(&results, &n);
+	TraversalStats s = StatsContribution::reduced(results[0], results[1]);
+	delete [] results;
+	return s;
+}
+#endif
+
+};
+
+#else
+#  define PARATREET_COUNT(counter, n) /* not counting */
+#  define PARATREET_STACK_DEPTH /* not counting */
+#  define PARATREET_STAT(x) /* x */
+#endif
+
+#endif
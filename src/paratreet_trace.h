@@ -0,0 +1,213 @@
+/**
+ Phase timeline tracing for ParaTreeT: the parallel tree toolkit.
+
+ Drivers wrap their stages (build, upward pass, decomposition, walk,
+ output...) in scoped PARATREET_TRACE_PHASE timers.  While tracing is on,
+ each thread appends a complete event to its own buffer as a phase ends;
+ the buffers are then written as a Chrome trace JSON file, with one
+ timeline per thread (or per PE under Charm++), which chrome://tracing and
+ Perfetto open offline.
+
+ Tracing is switched on at run time, by setting PARATREET_TRACE to the file
+ to write.  While it is off a phase costs one relaxed load and a branch.
+*/
+#ifndef __PARATREET_TRACE_HEADER
+#define __PARATREET_TRACE_HEADER
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#ifdef __CHARMC__
+#include "charm++.h"
+#endif
+
+/// Time the rest of the enclosing scope as a phase with this (literal) name
+#define PARATREET_TRACE_PHASE(name) ParaTreeT::TracePhase paratreetPhase(name)
+
+namespace ParaTreeT {
+
+/// One phase of one thread, in microseconds.  Plain data, so PEs can send their events to be written.
+struct TraceEvent {
+	char name[32];
+	double start, duration;
+	int pid, tid; // process and thread (or PE) of the timeline
+};
+
+/// Is tracing on in this process?
+inline std::atomic<bool> &traceEnabled() {
+	static std::atomic<bool> on(false);
+	return on;
+}
+
+inline void traceEnable(bool on) {
+	traceEnabled().store(on, std::memory_order_relaxed);
+}
+
+/// Trace file named by PARATREET_TRACE, or NULL if tracing isn't wanted
+inline const char *traceFileFromEnv() {
+	const char *path = getenv("PARATREET_TRACE");
+	return (path && *path) ? path : NULL;
+}
+
+/// Microseconds on a clock shared by the PEs (Charm++), or since the first call
+inline double traceNow() {
+#ifdef __CHARMC__
+	return CkWallTimer()*1e6;
+#else
+	typedef std::chrono::steady_clock Clock;
+	static const Clock::time_point origin = Clock::now();
+	return std::chrono::duration<double, std::micro>(Clock::now() - origin).count();
+#endif
+}
+
+/// Event buffers of every thread, and the events of threads that have exited
+class TraceRegistry {
+	std::mutex lock;
+	std::vector<std::vector<TraceEvent> *> live;
+	std::vector<TraceEvent> retired;
+	int threads;
+public:
+	TraceRegistry() : threads(0) {}
+
+	/// Register a thread's buffer, returning its thread number
+	int enter(std::vector<TraceEvent> *events) {
+		std::lock_guard<std::mutex> g(lock);
+		live.push_back(events);
+		return threads++;
+	}
+	void leave(std::vector<TraceEvent> *events) {
+		std::lock_guard<std::mutex> g(lock);
+		retired.insert(retired.end(), events->begin(), events->end());
+		live.erase(std::find(live.begin(), live.end(), events));
+	}
+	/// Take the events of every thread, leaving the buffers empty.  Call once the traced work is over.
+	std::vector<TraceEvent> take() {
+		std::lock_guard<std::mutex> g(lock);
+		std::vector<TraceEvent> all;
+		all.swap(retired);
+		for (size_t i = 0; i < live.size(); i++) {
+			all.insert(all.end(), live[i]->begin(), live[i]->end());
+			live[i]->clear();
+		}
+		return all;
+	}
+};
+
+inline TraceRegistry &traceRegistry() {
+	static TraceRegistry r;
+	return r;
+}
+
+/// This thread's events, and its timeline
+struct ThreadTrace {
+	std::vector<TraceEvent> events;
+	int pid, tid;
+	ThreadTrace() {
+		tid = traceRegistry().enter(&events);
+#ifdef __CHARMC__
+		pid = CkMyNode();
+		tid = CkMyPe();
+#else
+		pid = 0;
+#endif
+	}
+	~ThreadTrace() { traceRegistry().leave(&events); }
+};
+
+inline ThreadTrace &threadTrace() {
+	static thread_local ThreadTrace t;
+	return t;
+}
+
+/// Record a phase of this thread that started at start (see traceNow) and ends now
+inline void traceRecord(const char *name, double start) {
+	ThreadTrace &t = threadTrace();
+	TraceEvent e;
+	strncpy(e.name, name, sizeof(e.name) - 1);
+	e.name[sizeof(e.name) - 1] = '\0';
+	e.start = start;
+	e.duration = traceNow() - start;
+	e.pid = t.pid;
+	e.tid = t.tid;
+	t.events.push_back(e);
+}
+
+/// Start of a phase, or -1 if tracing is off
+inline double traceBegin() {
+	return traceEnabled().load(std::memory_order_relaxed) ? traceNow() : -1.0;
+}
+
+/// End a phase started by traceBegin, for phases that don't fit a scope
+inline void traceEnd(const char *name, double start) {
+	if (start >= 0.0) traceRecord(name, start);
+}
+
+/// Times a phase from its construction to the end of its scope
+class TracePhase {
+	const char *name;
+	double start;
+public:
+	TracePhase(const char *name) : name(name), start(traceBegin()) {}
+	~TracePhase() { traceEnd(name, start); }
+};
+
+/// Take the events of every thread of this process
+inline std::vector<TraceEvent> takeTraceEvents() {
+	return traceRegistry().take();
+}
+
+/// Take the events of this thread only: what a PE contributes to a gather
+inline std::vector<TraceEvent> takeThreadTraceEvents() {
+	std::vector<TraceEvent> mine;
+	mine.swap(threadTrace().events);
+	return mine;
+}
+
+/// Write events as a Chrome trace JSON file, naming each timeline by its thread (or PE)
+inline bool writeTrace(const char *path, const TraceEvent *events, size_t n) {
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		printf("ParaTreeT: can't write trace file %s\n", path);
+		return false;
+	}
+	fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	std::vector<std::pair<int, int> > timelines;
+	for (size_t i = 0; i < n; i++) {
+		const TraceEvent &e = events[i];
+		fprintf(f, "  {\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d},\n",
+				e.name, e.start, e.duration, e.pid, e.tid);
+		timelines.push_back(std::make_pair(e.pid, e.tid));
+	}
+	std::sort(timelines.begin(), timelines.end());
+	timelines.erase(std::unique(timelines.begin(), timelines.end()), timelines.end());
+#ifdef __CHARMC__
+	const char *threadKind = "PE";
+#else
+	const char *threadKind = "thread";
+#endif
+	for (size_t i = 0; i < timelines.size(); i++) {
+		fprintf(f, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"%s %d\"}},\n",
+				timelines[i].first, timelines[i].second, threadKind, timelines[i].second);
+		if (i == 0 || timelines[i].first != timelines[i - 1].first)
+			fprintf(f, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"process %d\"}},\n",
+					timelines[i].first, timelines[i].first);
+	}
+	// the format allows no trailing comma, so the last entry is a marker at the end of the trace
+	fprintf(f, "  {\"name\": \"end\", \"ph\": \"i\", \"s\": \"g\", \"ts\": %.3f, \"pid\": 0, \"tid\": 0}\n]}\n", traceNow());
+	return fclose(f) == 0;
+}
+
+/// Write the events of every thread of this process (for single-process drivers)
+inline bool writeTraceFile(const char *path) {
+	std::vector<TraceEvent> events = takeTraceEvents();
+	return writeTrace(path, events.data(), events.size());
+}
+
+};
+
+#endif